@@ -0,0 +1,305 @@
+/* Benchmarks every engine of regex.c and glibc's regcomp()/regexec() on the
+ * same patterns and generated inputs, and prints one CSV row per run:
+ *
+ * engine,pattern,input,lines,bytes,matches,compile_ns,mb_per_s,ns_per_match
+ *
+ * ns_per_match is the time of one match call, one per input line, or the
+ * share of a line in a call to regex_match_batch() for the batch rows. Set
+ * BENCH_SECONDS in the environment to change how long each run lasts.
+ */
+#include <regex.h> /* glibc's, regex.c's is "regex.h" */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "regex.h"
+
+typedef struct Input {
+        char *name;
+        char **lines;
+        size_t *lens;
+        int nlines;
+        size_t bytes;
+} Input;
+
+typedef struct Case {
+        char *pattern; /* the same syntax is ERE for regcomp(), no escapes */
+        Input *input;
+        bool skip_backtrack; /* takes forever */
+} Case;
+
+static const struct {
+        int flags;
+        char *name;
+} ENGINES[] = {
+        { 0, "default" },
+        { REGEX_BACKTRACK, "backtrack" },
+        { REGEX_NFA, "nfa" },
+        { REGEX_DFA, "dfa" },
+        { REGEX_JIT, "jit" },
+        { REGEX_GLUSHKOV, "glushkov" },
+};
+
+static double seconds = 0.2;
+
+static unsigned rng = 12345;
+
+static unsigned
+next_rand()
+{
+        rng = rng * 1103515245 + 12345;
+        return rng >> 16;
+}
+
+static double
+now()
+{
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static char *
+rand_str(const char *alphabet, int len)
+{
+        char *s = malloc(len + 1);
+        int k = strlen(alphabet);
+        for (int i = 0; i < len; i++)
+                s[i] = alphabet[next_rand() % k];
+        s[len] = 0;
+        return s;
+}
+
+static Input *
+input_new(char *name, int nlines)
+{
+        Input *in = calloc(1, sizeof(Input));
+        in->name = name;
+        in->nlines = nlines;
+        in->lines = calloc(nlines, sizeof(char *));
+        in->lens = calloc(nlines, sizeof(size_t));
+        return in;
+}
+
+static void
+input_done(Input *in)
+{
+        for (int i = 0; i < in->nlines; i++)
+                in->bytes += in->lens[i] = strlen(in->lines[i]);
+}
+
+static void
+input_free(Input *in)
+{
+        for (int i = 0; i < in->nlines; i++)
+                free(in->lines[i]);
+        free(in->lines);
+        free(in->lens);
+        free(in);
+}
+
+/* Addresses, a quarter of them broken */
+static Input *
+gen_emails()
+{
+        Input *in = input_new("emails", 2000);
+        for (int i = 0; i < in->nlines; i++) {
+                char *user = rand_str("abcdefghijklmnopqrstuvwxyz0123456789._", 4 + next_rand() % 12);
+                char *host = rand_str("abcdefghijklmnopqrstuvwxyz", 3 + next_rand() % 8);
+                /* a third .com, for patterns on it to match some */
+                char *tld = i % 3 ? rand_str("abcdefghijklmnopqrstuvwxyz", 2 + next_rand() % 2) : strdup("com");
+                in->lines[i] = malloc(64);
+                snprintf(in->lines[i], 64, "%s%s%s.%s", user, i % 4 ? "@" : "#", host, tld);
+                free(user);
+                free(host);
+                free(tld);
+        }
+        input_done(in);
+        return in;
+}
+
+/* Lines of short words */
+static Input *
+gen_text()
+{
+        static char *words[] = { "the", "cat", "sat", "on", "a", "mat", "with", "hat", "and", "bat" };
+        Input *in = input_new("text", 2000);
+        for (int i = 0; i < in->nlines; i++) {
+                in->lines[i] = calloc(1, 128);
+                for (int k = 0; k < 12; k++) {
+                        strcat(in->lines[i], words[next_rand() % 10]);
+                        strcat(in->lines[i], " ");
+                }
+        }
+        input_done(in);
+        return in;
+}
+
+/* Random strings over abc */
+static Input *
+gen_abc()
+{
+        Input *in = input_new("abc", 2000);
+        for (int i = 0; i < in->nlines; i++)
+                in->lines[i] = rand_str("abc", 64);
+        input_done(in);
+        return in;
+}
+
+/* a^n followed by tail, the classic exponential case for backtrackers */
+static Input *
+gen_as(char *name, int nlines, int n, char *tail)
+{
+        Input *in = input_new(name, nlines);
+        for (int i = 0; i < in->nlines; i++) {
+                in->lines[i] = malloc(n + strlen(tail) + 1);
+                memset(in->lines[i], 'a', n);
+                strcpy(in->lines[i] + n, tail);
+        }
+        input_done(in);
+        return in;
+}
+
+/* Runs match over the lines of in again and again for a while */
+#define MEASURE(in, match, calls, matches, elapsed)                              \
+        do {                                                                     \
+                double start_ = now();                                           \
+                calls = matches = 0;                                             \
+                do {                                                             \
+                        for (int i_ = 0; i_ < (in)->nlines; i_++) {              \
+                                const char *line = (in)->lines[i_];              \
+                                matches += (match);                              \
+                                (void) line;                                     \
+                        }                                                        \
+                        calls += (in)->nlines;                                   \
+                        elapsed = now() - start_;                                \
+                } while (elapsed < seconds);                                     \
+        } while (0)
+
+static void
+report(const char *engine, Case *c, long calls, long matches, double compile, double elapsed)
+{
+        long passes = calls / c->input->nlines;
+        printf("%s,\"%s\",%s,%d,%zu,%ld,%.0f,%.2f,%.1f\n", engine, c->pattern,
+               c->input->name, c->input->nlines, c->input->bytes,
+               matches / passes, compile * 1e9,
+               passes * c->input->bytes / elapsed / 1e6, elapsed / calls * 1e9);
+}
+
+static void
+bench_ours(Case *c, int e)
+{
+        const int ncompiles = 200;
+        long calls, matches;
+        double elapsed, start;
+        Regex r;
+
+        start = now();
+        for (int i = 0; i < ncompiles; i++) {
+                r = regex_compile_flags(c->pattern, ENGINES[e].flags);
+                regex_free(r);
+        }
+        double compile = (now() - start) / ncompiles;
+
+        r = regex_compile_flags(c->pattern, ENGINES[e].flags);
+        MEASURE(c->input, regex_match_n(r, line, strlen(line)), calls, matches, elapsed);
+        regex_free(r);
+        report(ENGINES[e].name, c, calls, matches, compile, elapsed);
+}
+
+/* Every line in one regex_match_batch() call, default engine */
+static void
+bench_batch(Case *c)
+{
+        const char **lines = (const char **) c->input->lines;
+        uint8_t *results = malloc(c->input->nlines);
+        long calls = 0, matches = 0;
+        double elapsed, compile, start = now();
+        Regex r = regex_compile(c->pattern);
+
+        compile = now() - start;
+        start = now();
+        do {
+                matches += regex_match_batch(r, lines, c->input->lens, c->input->nlines, results);
+                calls += c->input->nlines;
+                elapsed = now() - start;
+        } while (elapsed < seconds);
+        regex_free(r);
+        free(results);
+        report("batch", c, calls, matches, compile, elapsed);
+}
+
+static void
+bench_posix(Case *c)
+{
+        const int ncompiles = 200;
+        long calls, matches;
+        double elapsed, start;
+        regex_t r;
+
+        start = now();
+        for (int i = 0; i < ncompiles; i++) {
+                if (regcomp(&r, c->pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+                        fprintf(stderr, "regcomp failed on `%s`\n", c->pattern);
+                        exit(1);
+                }
+                regfree(&r);
+        }
+        double compile = (now() - start) / ncompiles;
+
+        regcomp(&r, c->pattern, REG_EXTENDED | REG_NOSUB);
+        MEASURE(c->input, regexec(&r, line, 0, NULL, 0) == 0, calls, matches, elapsed);
+        regfree(&r);
+        report("posix", c, calls, matches, compile, elapsed);
+}
+
+int
+main()
+{
+        char *env = getenv("BENCH_SECONDS");
+        if (env) seconds = atof(env);
+
+        Input *emails = gen_emails();
+        Input *text = gen_text();
+        Input *abc = gen_abc();
+        Input *as = gen_as("a^24", 16, 24, "");
+        Input *as_long = gen_as("a^4096", 16, 4096, "");
+        /* the b gets past the prefilter */
+        Input *as_cb = gen_as("a^12cb", 4, 12, "cb");
+        Input *as_cb_long = gen_as("a^4096cb", 16, 4096, "cb");
+        Case cases[] = {
+                { "^[A-Za-z0-9._%+-]+@[A-Za-z0-9.-]+[.][A-Za-z]{2,}$", emails, false },
+                { "@[a-z]+[.]com$", emails, false },
+                { ".at", text, false },
+                { "[hc]at", text, false },
+                { "a([ab]|c)*c", abc, false },
+                { "x(a|b)*y", abc, false },
+                { "(a*)*b", as, false },
+                { "(a*)*b", as_long, true },
+                { "(a*)*b", as_cb, false },
+                { "(a*)*b", as_cb_long, true },
+        };
+
+        printf("engine,pattern,input,lines,bytes,matches,compile_ns,mb_per_s,ns_per_match\n");
+        for (size_t i = 0; i < sizeof cases / sizeof *cases; i++) {
+                for (size_t e = 0; e < sizeof ENGINES / sizeof *ENGINES; e++) {
+                        if (ENGINES[e].flags == REGEX_BACKTRACK && cases[i].skip_backtrack)
+                                continue;
+                        bench_ours(&cases[i], e);
+                }
+                bench_batch(&cases[i]);
+                bench_posix(&cases[i]);
+                fflush(stdout);
+        }
+
+        input_free(emails);
+        input_free(text);
+        input_free(abc);
+        input_free(as);
+        input_free(as_long);
+        input_free(as_cb);
+        input_free(as_cb_long);
+        return 0;
+}
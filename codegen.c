@@ -0,0 +1,51 @@
+/* regex_codegen: patterns to C, ahead of time
+ *
+ * Writes a C file with one matcher per NAME PATTERN pair, each the fully
+ * built DFA of its pattern, so fixed rules can be compiled into a program
+ * and matched without compiling or interpreting anything at runtime.
+ */
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "regex.h"
+
+static void
+usage()
+{
+        fprintf(stderr, "Usage: regex_codegen NAME PATTERN [NAME PATTERN...]\n");
+        exit(2);
+}
+
+static bool
+is_identifier(const char *s)
+{
+        if (!isalpha((unsigned char) *s) && *s != '_') return false;
+        for (; *s; s++)
+                if (!isalnum((unsigned char) *s) && *s != '_') return false;
+        return true;
+}
+
+int
+main(int argc, char **argv)
+{
+        if (argc < 3 || argc % 2 == 0) usage();
+        for (int i = 1; i < argc; i += 2) {
+                if (!is_identifier(argv[i])) {
+                        fprintf(stderr, "regex_codegen: `%s` isn't a C identifier\n", argv[i]);
+                        return 2;
+                }
+        }
+
+        printf("/* Generated by regex_codegen, don't edit */\n");
+        printf("#include <stdbool.h>\n#include <stddef.h>\n#include <stdint.h>\n");
+        for (int i = 1; i < argc; i += 2) {
+                printf("\n");
+                if (!regex_codegen(argv[i + 1], argv[i], stdout)) {
+                        fprintf(stderr, "regex_codegen: `%s` is empty or its DFA is too big\n", argv[i + 1]);
+                        return 1;
+                }
+        }
+        return 0;
+}
@@ -1,9 +1,18 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__x86_64__) && defined(__linux__)
+#define HAVE_JIT
+#include <sys/mman.h>
+#endif
+
 #include "regex.h"
 
 static const char *TOKREPR[] = {
@@ -22,6 +31,8 @@ static const char *TOKREPR[] = {
         [MATCH_OR] = "MATCH_OR",
 };
 
+#define RANGE_INF -1
+
 #define todo(...)                                                                            \
         do {                                                                                 \
                 printf("No yet implemented: %s at " __FILE__ ":%d", __FUNCTION__, __LINE__); \
@@ -30,6 +41,83 @@ static const char *TOKREPR[] = {
                 exit(0);                                                                     \
         } while (0)
 
+/* Arena
+ *
+ * Everything a compiled Regex owns is allocated from its arena, so
+ * regex_free() is a couple of free() calls however big the pattern is.
+ * Blocks never move once allocated.
+ */
+#define ARENA_BLOCK (16 * 1024)
+
+typedef struct ArenaBlock {
+        struct ArenaBlock *next;
+        size_t used;
+        size_t cap;
+        max_align_t data[];
+} ArenaBlock;
+
+typedef struct Arena {
+        ArenaBlock *head;
+} Arena;
+
+static void *
+arena_alloc(Arena *a, size_t size)
+{
+        ArenaBlock *b = a->head;
+        void *p;
+
+        size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+        if (b == NULL || b->cap - b->used < size) {
+                size_t cap = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+                /* calloc'd and never reused, so arena memory is always zeroed */
+                b = calloc(1, sizeof(ArenaBlock) + cap);
+                b->next = a->head;
+                b->cap = cap;
+                a->head = b;
+        }
+        p = (char *) b->data + b->used;
+        b->used += size;
+        return p;
+}
+
+static Arena *
+arena_new()
+{
+        Arena tmp = { NULL };
+        Arena *a = arena_alloc(&tmp, sizeof(Arena));
+        a->head = tmp.head;
+        return a;
+}
+
+static void
+arena_free(Arena *a)
+{
+        ArenaBlock *b = a->head;
+        while (b) {
+                ArenaBlock *next = b->next;
+                free(b);
+                b = next;
+        }
+}
+
+/* Tokens live in one array and link to each other by index */
+#define NONE -1
+
+static inline RegexTok *
+tok_at(RegexTok *toks, int i)
+{
+        return i == NONE ? NULL : &toks[i];
+}
+
+typedef struct Parser {
+        char *c;
+        RegexTok *toks;
+        int ntoks;
+        char *lexemes; /* literal chars, in pattern order */
+        int nlexemes;
+        int ngroups;
+} Parser;
+
 static RegexTok *
 get_group_n(int i)
 {
@@ -38,118 +126,116 @@ get_group_n(int i)
 }
 
 static inline RegexTok *
-new_regextok()
+new_regextok(Parser *p, int type)
 {
-        return calloc(1, sizeof(RegexTok));
+        RegexTok *tok = &p->toks[p->ntoks++];
+        memset(tok, 0, sizeof *tok);
+        tok->type = type;
+        tok->next = NONE;
+        return tok;
 }
 
 static RegexTok *
-new_start_of_line()
+new_start_of_line(Parser *p)
 {
-        RegexTok *tok = new_regextok();
-        tok->type = START_OF_LINE;
-        return tok;
+        return new_regextok(p, START_OF_LINE);
 }
 
 static RegexTok *
-new_end_of_line()
+new_end_of_line(Parser *p)
 {
-        RegexTok *tok = new_regextok();
-        tok->type = END_OF_LINE;
-        return tok;
+        return new_regextok(p, END_OF_LINE);
 }
 
 static RegexTok *
-new_any_char()
+new_any_char(Parser *p)
 {
-        RegexTok *tok = new_regextok();
-        tok->type = ANY_CHAR;
-        return tok;
+        return new_regextok(p, ANY_CHAR);
 }
 
 static RegexTok *
-new_bracket_expr()
+new_bracket_expr(Parser *p)
 {
-        RegexTok *tok = new_regextok();
-        tok->type = BRACKET_EXPR;
+        RegexTok *tok = new_regextok(p, BRACKET_EXPR);
+        tok->bracket_expr.body = NONE;
         return tok;
 }
 
 static RegexTok *
-new_bracket_expr_excl()
+new_bracket_expr_excl(Parser *p)
 {
-        RegexTok *tok = new_regextok();
-        tok->type = BRACKET_EXPR_EXCL;
+        RegexTok *tok = new_regextok(p, BRACKET_EXPR_EXCL);
+        tok->bracket_expr.body = NONE;
         return tok;
 }
 
 static RegexTok *
-new_group()
+new_group(Parser *p)
 {
-        RegexTok *tok = new_regextok();
-        tok->type = GROUP;
-        tok->group.id = 0; // TODO
+        RegexTok *tok = new_regextok(p, GROUP);
+        tok->group.body = NONE;
+        tok->group.id = ++p->ngroups; /* numbered by their open paren */
         return tok;
 }
 
 static RegexTok *
-new_match_group(char c)
+new_match_group(Parser *p, char c)
 {
-        RegexTok *tok = new_regextok();
-        tok->type = MATCH_GROUP;
-        tok->match_group.group = get_group_n(c - '0');
+        RegexTok *tok = new_regextok(p, MATCH_GROUP);
+        tok->match_group.group = get_group_n(c - '0') - p->toks;
         return tok;
 }
 
 static RegexTok *
-new_match_zero_more()
+new_match_zero_more(Parser *p)
 {
-        RegexTok *tok = new_regextok();
-        tok->type = MATCH_ZERO_MORE;
+        RegexTok *tok = new_regextok(p, MATCH_ZERO_MORE);
+        tok->match_zero_more.match = NONE;
         return tok;
 }
 
 static RegexTok *
-new_match_zero_one()
+new_match_zero_one(Parser *p)
 {
-        RegexTok *tok = new_regextok();
-        tok->type = MATCH_ZERO_ONE;
+        RegexTok *tok = new_regextok(p, MATCH_ZERO_ONE);
+        tok->match_zero_one.match = NONE;
         return tok;
 }
 
 static RegexTok *
-new_match_one_more()
+new_match_one_more(Parser *p)
 {
-        RegexTok *tok = new_regextok();
-        tok->type = MATCH_ONE_MORE;
+        RegexTok *tok = new_regextok(p, MATCH_ONE_MORE);
+        tok->match_one_more.match = NONE;
         return tok;
 }
 
 static RegexTok *
-new_match_range()
+new_match_range(Parser *p)
 {
-        RegexTok *tok = new_regextok();
-        tok->type = MATCH_RANGE;
+        RegexTok *tok = new_regextok(p, MATCH_RANGE);
+        tok->match_range.match = NONE;
+        tok->match_range.range = NONE;
         return tok;
 }
 
 static RegexTok *
-new_match_or()
+new_match_or(Parser *p)
 {
-        RegexTok *tok = new_regextok();
-        tok->type = MATCH_OR;
+        RegexTok *tok = new_regextok(p, MATCH_OR);
+        tok->match_or.left = NONE;
+        tok->match_or.right = NONE;
         return tok;
 }
 
 static RegexTok *
-new_literal(char *lit)
+new_literal(Parser *p, char *lit)
 {
-        RegexTok *tok = new_regextok();
-        tok->type = LITERAL;
-        assert(tok->lexeme == NULL);
+        RegexTok *tok = new_regextok(p, LITERAL);
         /* for now it only accept a single char */
-        tok->lexeme = strdup(" ");
+        tok->lexeme = p->lexemes + p->nlexemes++;
         tok->lexeme[0] = *lit;
+        tok->literal.len = 1;
         return tok;
 }
 
@@ -172,215 +258,231 @@ new_literal(char *lit)
  */
 
 static bool
-match(char **c, char *word)
+match(Parser *p, char *word)
 {
         int len = strlen(word);
-        if (len == 0) return **c == 0; // for test that *c == ""
-        if (memcmp(word, *c, len) == 0) {
-                *c += len;
+        if (len == 0) return *p->c == 0; // for test that *c == ""
+        if (memcmp(word, p->c, len) == 0) {
+                p->c += len;
                 return true;
         }
         return false;
 }
 
 static void
-expect_consume(char **c, char *word)
+expect_consume(Parser *p, char *word)
 {
-        if (match(c, word)) return;
+        if (match(p, word)) return;
         fprintf(stderr, "Expected `%s` but got `%-*s`\n",
-                word, (int) strlen(word), *c);
+                word, (int) strlen(word), p->c);
         exit(1);
 }
 
-static RegexTok *get_group(char **);
-static RegexTok *get_start_of_line(char **);
-static RegexTok *get_end_of_line(char **);
-static RegexTok *get_any_char(char **);
-static RegexTok *get_bracket_expr_excl(char **);
-static RegexTok *get_bracket_expr(char **);
-static RegexTok *get_match_group(char **);
-static RegexTok *get_match_zero_more(char **);
-static RegexTok *get_match_zero_one(char **);
-static RegexTok *get_match_one_more(char **);
-static RegexTok *get_match_range(char **);
-static RegexTok *get_match_or(char **);
-static RegexTok *get_literal(char **);
+static RegexTok *get_group(Parser *);
+static RegexTok *get_start_of_line(Parser *);
+static RegexTok *get_end_of_line(Parser *);
+static RegexTok *get_any_char(Parser *);
+static RegexTok *get_bracket_expr_excl(Parser *);
+static RegexTok *get_bracket_expr(Parser *);
+static RegexTok *get_match_group(Parser *);
+static RegexTok *get_match_zero_more(Parser *);
+static RegexTok *get_match_zero_one(Parser *);
+static RegexTok *get_match_one_more(Parser *);
+static RegexTok *get_match_range(Parser *);
+static RegexTok *get_match_or(Parser *);
+static RegexTok *get_literal(Parser *);
 
 static RegexTok *
-get_group(char **c)
+get_group(Parser *p)
 {
-        if (match(c, "(")) {
-                RegexTok *t = new_group();
-                RegexTok **last = &t->group.body;
-                while (!match(c, ")")) {
-                        *last = get_group(c);
-                        last = &(*last)->next;
+        if (match(p, "(")) {
+                RegexTok *t = new_group(p);
+                int *last = &t->group.body;
+                while (!match(p, ")")) {
+                        RegexTok *tok = get_group(p);
+                        *last = tok - p->toks;
+                        last = &tok->next;
                 }
                 return t;
         }
-        return get_start_of_line(c);
+        return get_start_of_line(p);
 };
 
 static RegexTok *
-get_start_of_line(char **c)
+get_start_of_line(Parser *p)
 {
-        if (match(c, "^")) {
-                return new_start_of_line();
+        if (match(p, "^")) {
+                return new_start_of_line(p);
         }
-        return get_end_of_line(c);
+        return get_end_of_line(p);
 };
 
 static RegexTok *
-get_end_of_line(char **c)
+get_end_of_line(Parser *p)
 {
-        if (match(c, "$")) {
-                RegexTok *t = new_end_of_line();
-                expect_consume(c, "");
+        if (match(p, "$")) {
+                RegexTok *t = new_end_of_line(p);
+                expect_consume(p, "");
                 return t;
         }
-        return get_any_char(c);
+        return get_any_char(p);
 };
 
 static RegexTok *
-get_any_char(char **c)
+get_any_char(Parser *p)
 {
-        if (match(c, ".")) {
-                return new_any_char();
+        if (match(p, ".")) {
+                return new_any_char(p);
         }
-        return get_bracket_expr_excl(c);
+        return get_bracket_expr_excl(p);
 };
 
+static void
+get_bracket_body(Parser *p, RegexTok *t)
+{
+        int *last = &t->bracket_expr.body;
+        while (!match(p, "]")) {
+                if (*p->c == '\\') ++p->c;
+                RegexTok *tok = get_literal(p);
+                *last = tok - p->toks;
+                last = &tok->next;
+        }
+}
+
 static RegexTok *
-get_bracket_expr_excl(char **c)
+get_bracket_expr_excl(Parser *p)
 {
-        if (match(c, "[^")) {
-                RegexTok *t = new_bracket_expr_excl();
-                RegexTok **last = &t->bracket_expr.body;
-                while (!match(c, "]")) {
-                        if (**c == '\\') ++*c;
-                        *last = get_literal(c);
-                        last = &(*last)->next;
-                }
+        if (match(p, "[^")) {
+                RegexTok *t = new_bracket_expr_excl(p);
+                get_bracket_body(p, t);
                 return t;
         }
-        return get_bracket_expr(c);
+        return get_bracket_expr(p);
 };
 
 static RegexTok *
-get_bracket_expr(char **c)
+get_bracket_expr(Parser *p)
 {
-        if (match(c, "[")) {
-                RegexTok *t = new_bracket_expr();
-                RegexTok **last = &t->bracket_expr.body;
-                while (!match(c, "]")) {
-                        if (**c == '\\') ++*c;
-                        *last = get_literal(c);
-                        last = &(*last)->next;
-                }
+        if (match(p, "[")) {
+                RegexTok *t = new_bracket_expr(p);
+                get_bracket_body(p, t);
                 return t;
         }
-        return get_match_group(c);
+        return get_match_group(p);
 };
 
 static RegexTok *
-get_match_group(char **c)
+get_match_group(Parser *p)
 {
-        if (match(c, "\\") && ('1' <= **c && **c <= '9')) {
-                return new_match_group(*((*c)++));
+        if (match(p, "\\") && ('1' <= *p->c && *p->c <= '9')) {
+                return new_match_group(p, *p->c++);
         }
-        return get_match_zero_more(c);
+        return get_match_zero_more(p);
 };
 
 static RegexTok *
-get_match_zero_more(char **c)
+get_match_zero_more(Parser *p)
 {
-        if (match(c, "*")) {
-                return new_match_zero_more();
+        if (match(p, "*")) {
+                return new_match_zero_more(p);
         }
-        return get_match_zero_one(c);
+        return get_match_zero_one(p);
 }
 
 static RegexTok *
-get_match_zero_one(char **c)
+get_match_zero_one(Parser *p)
 {
-        if (match(c, "?")) {
-                return new_match_zero_one();
+        if (match(p, "?")) {
+                return new_match_zero_one(p);
         }
-        return get_match_one_more(c);
+        return get_match_one_more(p);
 }
 
 static RegexTok *
-get_match_one_more(char **c)
+get_match_one_more(Parser *p)
 {
-        if (match(c, "+")) {
-                return new_match_one_more();
+        if (match(p, "+")) {
+                return new_match_one_more(p);
         }
-        return get_match_or(c);
+        return get_match_or(p);
 }
 
 static RegexTok *
-get_match_or(char **c)
+get_match_or(Parser *p)
 {
-        if (match(c, "|")) {
-                RegexTok *t = new_match_or();
-                t->match_or.right = get_group(c);
+        if (match(p, "|")) {
+                RegexTok *t = new_match_or(p);
+                t->match_or.right = get_group(p) - p->toks;
                 return t;
         }
-        return get_match_range(c);
+        return get_match_range(p);
+}
+
+/* {m,n} -> [m, n], {m,} -> [m, inf), {,n} -> [0, n], {m} -> [m, m] */
+static void
+set_range_bounds(RegexTok *t, char *c)
+{
+        t->match_range.min = atoi(c);
+        t->match_range.max = t->match_range.min;
+        while (*c != '}' && *c != ',') ++c;
+        if (*c == ',')
+                t->match_range.max = c[1] == '}' ? RANGE_INF : atoi(c + 1);
 }
 
 static RegexTok *
-get_match_range(char **c)
+get_match_range(Parser *p)
 {
-        if (match(c, "{")) {
-                RegexTok *t = new_match_range();
-                RegexTok **last = &t->match_range.range;
-                while (!match(c, "}")) {
-                        *last = get_literal(c);
-                        last = &(*last)->next;
+        if (match(p, "{")) {
+                RegexTok *t = new_match_range(p);
+                int *last = &t->match_range.range;
+                set_range_bounds(t, p->c);
+                while (!match(p, "}")) {
+                        RegexTok *tok = get_literal(p);
+                        *last = tok - p->toks;
+                        last = &tok->next;
                 }
                 return t;
         }
-        return get_literal(c);
+        return get_literal(p);
 };
 
 static RegexTok *
-get_literal(char **c)
+get_literal(Parser *p)
 {
-        return new_literal((*c)++);
+        return new_literal(p, p->c++);
 };
 
 static void
-merge_literals(RegexTok *t)
+merge_literals(RegexTok *toks, RegexTok *t)
 {
         while (t) {
                 switch (t->type) {
                 case BRACKET_EXPR:
                 case BRACKET_EXPR_EXCL:
-                        merge_literals(t->bracket_expr.body);
+                        merge_literals(toks, tok_at(toks, t->bracket_expr.body));
                         break;
                 case MATCH_RANGE:
-                        merge_literals(t->match_range.match);
-                        merge_literals(t->match_range.range);
+                        merge_literals(toks, tok_at(toks, t->match_range.match));
+                        merge_literals(toks, tok_at(toks, t->match_range.range));
                         break;
                 case MATCH_GROUP:
-                        merge_literals(t->match_group.group);
+                        merge_literals(toks, tok_at(toks, t->match_group.group));
                         break;
                 case GROUP:
-                        merge_literals(t->group.body);
+                        merge_literals(toks, tok_at(toks, t->group.body));
                         break;
                 case MATCH_OR:
-                        merge_literals(t->match_or.left);
-                        merge_literals(t->match_or.right);
+                        merge_literals(toks, tok_at(toks, t->match_or.left));
+                        merge_literals(toks, tok_at(toks, t->match_or.right));
                         break;
                 case MATCH_ZERO_MORE:
-                        merge_literals(t->match_zero_more.match);
+                        merge_literals(toks, tok_at(toks, t->match_zero_more.match));
                         break;
                 case MATCH_ONE_MORE:
-                        merge_literals(t->match_one_more.match);
+                        merge_literals(toks, tok_at(toks, t->match_one_more.match));
                         break;
                 case MATCH_ZERO_ONE:
-                        merge_literals(t->match_zero_one.match);
+                        merge_literals(toks, tok_at(toks, t->match_zero_one.match));
                         break;
                 case START_OF_LINE:
                 case END_OF_LINE:
@@ -391,78 +493,272 @@ merge_literals(RegexTok *t)
                         todo("case for %s", TOKREPR[t->type]);
                 }
 
-                if (t->next == NULL) break;
+                RegexTok *next = tok_at(toks, t->next);
+                if (next == NULL) break;
 
-                if (t->type != LITERAL || t->next->type != LITERAL) {
-                        t = t->next;
+                if (t->type != LITERAL || next->type != LITERAL) {
+                        t = next;
                         continue;
                 }
 
-                t->lexeme = realloc(t->lexeme, strlen(t->lexeme) + strlen(t->next->lexeme) + 1);
-                strcat(t->lexeme, t->next->lexeme);
-                free(t->next->lexeme);
-                t->next = t->next->next;
+                /* consecutive literals are consecutive in p->lexemes too */
+                assert(t->lexeme + t->literal.len == next->lexeme);
+                t->literal.len += next->literal.len;
+                t->next = next->next;
+        }
+}
+
+static void swap_operators(RegexTok *toks, int *first);
+
+static void
+swap_group_operators(RegexTok *toks, RegexTok *t)
+{
+        if (t == NULL) return;
+        switch (t->type) {
+        case GROUP:
+                swap_operators(toks, &t->group.body);
+                break;
+        case MATCH_ZERO_MORE:
+                swap_group_operators(toks, tok_at(toks, t->match_zero_more.match));
+                break;
+        case MATCH_ZERO_ONE:
+                swap_group_operators(toks, tok_at(toks, t->match_zero_one.match));
+                break;
+        case MATCH_ONE_MORE:
+                swap_group_operators(toks, tok_at(toks, t->match_one_more.match));
+                break;
+        case MATCH_RANGE:
+                swap_group_operators(toks, tok_at(toks, t->match_range.match));
+                break;
+        case MATCH_OR:
+                swap_group_operators(toks, tok_at(toks, t->match_or.left));
+                swap_group_operators(toks, tok_at(toks, t->match_or.right));
+                break;
+        default:
+                break;
         }
 }
 
 static void
-swap_operators(RegexTok **first)
+swap_operators(RegexTok *toks, int *first)
 {
         /* swap .* to *(.) */
-        RegexTok **t = first;
-        while (*t && (*t)->next) {
-                if ((*t)->next->type == MATCH_ZERO_MORE) {
-                        (*t)->next->match_zero_more.match = *t;
-                        *t = (*t)->next;
-                        (*t)->match_zero_more.match->next = NULL;
+        int *t = first;
+        while (*t != NONE && toks[*t].next != NONE) {
+                int cur = *t;
+                int op = toks[cur].next;
+                int *operand = NULL;
+
+                switch (toks[op].type) {
+                case MATCH_ZERO_MORE:
+                        operand = &toks[op].match_zero_more.match;
+                        break;
+                case MATCH_ZERO_ONE:
+                        operand = &toks[op].match_zero_one.match;
+                        break;
+                case MATCH_ONE_MORE:
+                        operand = &toks[op].match_one_more.match;
+                        break;
+                case MATCH_RANGE:
+                        operand = &toks[op].match_range.match;
+                        break;
+                case MATCH_OR:
+                        operand = &toks[op].match_or.left;
+                        break;
+                default:
+                        break;
+                }
+
+                if (operand) {
+                        *operand = cur;
+                        *t = op;
+                        toks[cur].next = NONE;
+                }
+
+                t = &toks[*t].next;
+        }
 
-                } else if ((*t)->next->type == MATCH_ZERO_ONE) {
-                        (*t)->next->match_zero_one.match = *t;
-                        *t = (*t)->next;
-                        (*t)->match_zero_one.match->next = NULL;
+        /* group bodies are token lists of their own */
+        for (t = first; *t != NONE; t = &toks[*t].next)
+                swap_group_operators(toks, &toks[*t]);
+}
+
+static inline bool
+class_has(const RegexClass *class, unsigned char c)
+{
+        return (class->bits[c >> 6] >> (c & 63)) & 1;
+}
 
-                } else if ((*t)->next->type == MATCH_ONE_MORE) {
-                        (*t)->next->match_one_more.match = *t;
-                        *t = (*t)->next;
-                        (*t)->match_one_more.match->next = NULL;
+static inline void
+class_add(RegexClass *class, unsigned char c)
+{
+        class->bits[c >> 6] |= (uint64_t) 1 << (c & 63);
+}
 
-                } else if ((*t)->next->type == MATCH_RANGE) {
-                        (*t)->next->match_range.match = *t;
-                        *t = (*t)->next;
-                        (*t)->match_range.match->next = NULL;
+typedef struct ClassList {
+        RegexClass **items;
+        int len;
+        int cap;
+} ClassList;
+
+/* Turn the bracket body into a byte set. The same set is shared by every
+ * bracket expression of the regex that needs it. */
+static RegexClass *
+compile_class(Arena *a, RegexTok *toks, RegexTok *t, ClassList *classes)
+{
+        RegexClass class = { 0 };
+        RegexTok *body = tok_at(toks, t->bracket_expr.body);
 
-                } else if ((*t)->next->type == MATCH_OR) {
-                        (*t)->next->match_or.left = *t;
-                        *t = (*t)->next;
-                        (*t)->match_or.left->next = NULL;
+        for (int i = 0; body && i < body->literal.len; i++) {
+                unsigned char lo = body->lexeme[i];
+                unsigned char hi = lo;
+                if (i + 2 < body->literal.len && body->lexeme[i + 1] == '-') {
+                        hi = body->lexeme[i + 2];
+                        i += 2;
                 }
+                for (int c = lo; c <= hi; c++)
+                        class_add(&class, c);
+        }
+        if (t->type == BRACKET_EXPR_EXCL)
+                for (int i = 0; i < 4; i++)
+                        class.bits[i] = ~class.bits[i];
+
+        for (int i = 0; i < classes->len; i++)
+                if (memcmp(classes->items[i], &class, sizeof class) == 0)
+                        return classes->items[i];
 
-                t = &(*t)->next;
+        if (classes->len == classes->cap) {
+                classes->cap = classes->cap ? classes->cap * 2 : 4;
+                classes->items = realloc(classes->items, classes->cap * sizeof *classes->items);
         }
+        RegexClass *new = arena_alloc(a, sizeof class);
+        *new = class;
+        return classes->items[classes->len++] = new;
 }
 
-static RegexTok *
-get_tokens(char *expr)
-{
-        RegexTok *t = new_regextok();
-        RegexTok *last = t;
-        char **cur = &expr;
-        while (**cur) {
-                last->next = get_group(cur);
-                last = last->next;
-        }
-        last = t->next;
-        swap_operators(&last);
-        merge_literals(last);
-        free(t);
-        return last;
+static void
+compile_classes(Arena *a, RegexTok *toks, RegexTok *t, ClassList *classes)
+{
+        for (; t; t = tok_at(toks, t->next)) {
+                switch (t->type) {
+                case BRACKET_EXPR:
+                case BRACKET_EXPR_EXCL:
+                        t->bracket_expr.class = compile_class(a, toks, t, classes);
+                        break;
+                case GROUP:
+                        compile_classes(a, toks, tok_at(toks, t->group.body), classes);
+                        break;
+                case MATCH_ZERO_MORE:
+                        compile_classes(a, toks, tok_at(toks, t->match_zero_more.match), classes);
+                        break;
+                case MATCH_ZERO_ONE:
+                        compile_classes(a, toks, tok_at(toks, t->match_zero_one.match), classes);
+                        break;
+                case MATCH_ONE_MORE:
+                        compile_classes(a, toks, tok_at(toks, t->match_one_more.match), classes);
+                        break;
+                case MATCH_RANGE:
+                        compile_classes(a, toks, tok_at(toks, t->match_range.match), classes);
+                        break;
+                case MATCH_OR:
+                        compile_classes(a, toks, tok_at(toks, t->match_or.left), classes);
+                        compile_classes(a, toks, tok_at(toks, t->match_or.right), classes);
+                        break;
+                default:
+                        break;
+                }
+        }
+}
+
+/* Copy the list starting at t to out in pre-order, so every token is
+ * followed by its operands. Returns the index of the copy of t. */
+static int
+flatten(RegexTok *toks, int t, RegexTok *out, int *n)
+{
+        int first = NONE;
+        int *last = &first;
+
+        for (; t != NONE; t = toks[t].next) {
+                int i = (*n)++;
+                RegexTok *tok = &out[i];
+                *tok = toks[t];
+                *last = i;
+                last = &tok->next;
+                switch (tok->type) {
+                case BRACKET_EXPR:
+                case BRACKET_EXPR_EXCL:
+                        tok->bracket_expr.body = flatten(toks, tok->bracket_expr.body, out, n);
+                        break;
+                case GROUP:
+                        tok->group.body = flatten(toks, tok->group.body, out, n);
+                        break;
+                case MATCH_ZERO_MORE:
+                        tok->match_zero_more.match = flatten(toks, tok->match_zero_more.match, out, n);
+                        break;
+                case MATCH_ZERO_ONE:
+                        tok->match_zero_one.match = flatten(toks, tok->match_zero_one.match, out, n);
+                        break;
+                case MATCH_ONE_MORE:
+                        tok->match_one_more.match = flatten(toks, tok->match_one_more.match, out, n);
+                        break;
+                case MATCH_RANGE:
+                        tok->match_range.match = flatten(toks, tok->match_range.match, out, n);
+                        tok->match_range.range = flatten(toks, tok->match_range.range, out, n);
+                        break;
+                case MATCH_OR:
+                        tok->match_or.left = flatten(toks, tok->match_or.left, out, n);
+                        tok->match_or.right = flatten(toks, tok->match_or.right, out, n);
+                        break;
+                default:
+                        break;
+                }
+        }
+        *last = NONE;
+        return first;
+}
+
+/* Parse expr into r->tokens, the first token of the expression is r->tokens[0] */
+static void
+get_tokens(Regex *r, char *expr)
+{
+        ClassList classes = { 0 };
+        size_t len = strlen(expr);
+        /* every token eats at least a char of expr */
+        Parser p = {
+                .c = expr,
+                .toks = malloc((len + 1) * sizeof(RegexTok)),
+                .lexemes = arena_alloc(r->arena, len + 1),
+        };
+        int first = NONE;
+        int *last = &first;
+
+        while (*p.c) {
+                RegexTok *tok = get_group(&p);
+                *last = tok - p.toks;
+                last = &tok->next;
+        }
+        swap_operators(p.toks, &first);
+        merge_literals(p.toks, tok_at(p.toks, first));
+        compile_classes(r->arena, p.toks, tok_at(p.toks, first), &classes);
+
+        r->ngroups = p.ngroups;
+        r->ntokens = 0;
+        r->tokens = arena_alloc(r->arena, (p.ntoks + 1) * sizeof(RegexTok));
+        flatten(p.toks, first, r->tokens, &r->ntokens);
+        if (r->ntokens == 0) r->tokens = NULL;
+
+        free(classes.items);
+        free(p.toks);
 };
 
 #define INDENT 4
+/* counts, if not NULL, go in a column on the left */
 static void
-print_token_ast_branch(RegexTok *r, int indent)
+print_token_ast_branch(RegexTok *toks, int i, int indent, _Atomic uint64_t *counts)
 {
+        RegexTok *r = tok_at(toks, i);
         if (r == NULL) return;
+        if (counts) printf("%12llu  ", (unsigned long long) atomic_load_explicit(&counts[i], memory_order_relaxed));
         printf("%*s", indent, ""); // indentation
         switch (r->type) {
         case START_OF_LINE:
@@ -476,45 +772,45 @@ print_token_ast_branch(RegexTok *r, int indent)
                 break;
         case BRACKET_EXPR:
                 printf("- Bracket expression `[` ... `]`\n");
-                for (RegexTok *t = r->bracket_expr.body; t; t = t->next)
-                        print_token_ast_branch(t, indent + INDENT);
+                for (int t = r->bracket_expr.body; t != NONE; t = toks[t].next)
+                        print_token_ast_branch(toks, t, indent + INDENT, counts);
                 break;
         case BRACKET_EXPR_EXCL:
                 printf("- Bracket expression exclude `[^` ... `]`\n");
-                for (RegexTok *t = r->bracket_expr.body; t; t = t->next)
-                        print_token_ast_branch(t, indent + INDENT);
+                for (int t = r->bracket_expr.body; t != NONE; t = toks[t].next)
+                        print_token_ast_branch(toks, t, indent + INDENT, counts);
                 break;
         case GROUP:
                 printf("- Group `(` ... `)`\n");
-                print_token_ast_branch(r->group.body, indent + INDENT);
+                print_token_ast_branch(toks, r->group.body, indent + INDENT, counts);
                 break;
         case MATCH_GROUP:
                 printf("- Match Group `%d` <- TODO `\\%%d`\n", 0); // TODO
                 break;
         case MATCH_ZERO_MORE:
                 printf("- Match Zero or More `*`\n");
-                print_token_ast_branch(r->match_zero_more.match, indent + INDENT);
+                print_token_ast_branch(toks, r->match_zero_more.match, indent + INDENT, counts);
                 break;
         case MATCH_ZERO_ONE:
                 printf("- Match Zero or One `?`\n");
-                print_token_ast_branch(r->match_zero_one.match, indent + INDENT);
+                print_token_ast_branch(toks, r->match_zero_one.match, indent + INDENT, counts);
                 break;
         case MATCH_ONE_MORE:
                 printf("- Match One or More `+`\n");
-                print_token_ast_branch(r->match_one_more.match, indent + INDENT);
+                print_token_ast_branch(toks, r->match_one_more.match, indent + INDENT, counts);
                 break;
         case MATCH_RANGE:
                 printf("- Match Range `{` a , b `}`\n");
-                print_token_ast_branch(r->match_range.match, indent + INDENT);
-                print_token_ast_branch(r->match_range.range, indent + INDENT);
+                print_token_ast_branch(toks, r->match_range.match, indent + INDENT, counts);
+                print_token_ast_branch(toks, r->match_range.range, indent + INDENT, counts);
                 break;
         case MATCH_OR:
                 printf("- Match Or `|`\n");
-                print_token_ast_branch(r->match_or.left, indent + INDENT);
-                print_token_ast_branch(r->match_or.right, indent + INDENT);
+                print_token_ast_branch(toks, r->match_or.left, indent + INDENT, counts);
+                print_token_ast_branch(toks, r->match_or.right, indent + INDENT, counts);
                 break;
         case LITERAL:
-                printf("- Literal `%s`\n", r->lexeme);
+                printf("- Literal `%.*s`\n", r->literal.len, r->lexeme);
                 break;
         default:
                 todo("case for %s", TOKREPR[r->type]);
@@ -524,185 +820,3467 @@ print_token_ast_branch(RegexTok *r, int indent)
 void
 print_token_ast(Regex r)
 {
-        RegexTok *t;
         printf("Expr: `%s`\n", regex_repr(r));
-        for (t = r.tokens; t; t = t->next)
-                print_token_ast_branch(t, 0);
+        for (int t = r.tokens ? 0 : NONE; t != NONE; t = r.tokens[t].next)
+                print_token_ast_branch(r.tokens, t, 0, NULL);
 }
 
-Regex
-regex_compile(char *expr)
+/* Thompson NFA
+ *
+ * The token tree is lowered to a list of states. CHAR, ANY, CLASS, BOL, EOL
+ * and SAVE continue at the next state, SPLIT and JMP hold explicit targets.
+ * Any number of them can be active at once, so matching never backtracks.
+ * SPLIT prefers x over y, which is what gives the Pike VM its leftmost-first
+ * submatches. SAVE records the position in capture slot x, the other
+ * engines just step over it.
+ */
+typedef struct NfaState {
+        enum {
+                NFA_CHAR,
+                NFA_ANY,
+                NFA_CLASS,
+                NFA_SPLIT,
+                NFA_JMP,
+                NFA_BOL,
+                NFA_EOL,
+                NFA_SAVE,
+                NFA_MATCH,
+        } op;
+        unsigned char c;
+        const RegexClass *class;
+        int x, y;
+} NfaState;
+
+typedef struct Nfa {
+        NfaState *states;
+        int len;
+        int cap;
+        int nslots; /* 2 per capture group, group 0 being the whole match */
+        bool anchored;
+        bool reverse; /* reads the input from the end back to the start */
+} Nfa;
+
+/* Byte pos of buf as n reads it */
+static inline char
+nfa_byte(Nfa *n, const char *buf, size_t len, size_t pos)
 {
-        Regex r;
-        r.repr = strdup(expr);
-        r.tokens = get_tokens(expr);
-        return r;
+        return n->reverse ? buf[len - 1 - pos] : buf[pos];
 }
 
-static bool
-char_in_str(char chr, char *str)
+static int
+nfa_emit(Nfa *n, int op)
 {
-        if (strchr(str, chr) == NULL) {
-                // check ranges
-                char *c = str;
-                while ((c = strchr(c, '-')) && c != str && c[1]) {
-                        if (c[-1] <= chr && chr <= c[1]) return true;
-                        ++c;
-                }
-                return false;
+        if (n->len == n->cap) {
+                n->cap = n->cap ? n->cap * 2 : 16;
+                n->states = realloc(n->states, n->cap * sizeof *n->states);
         }
-        return true;
+        n->states[n->len] = (NfaState) { .op = op };
+        return n->len++;
 }
 
-static bool eval(RegexTok *t, char *str, int offset, int *result);
+static void nfa_compile_seq(Nfa *n, RegexTok *toks, int t);
 
-static bool
-match_range(RegexTok *teval, RegexTok *tnext, char *str, int offset, int *result, int min, int max)
+static void
+nfa_compile_star(Nfa *n, RegexTok *toks, int t)
 {
-        int n;
-        int ret;
-        while (1) {
-                ret = 0;
-                for (int i = 0; i < max; i++) {
-                        if (!eval(teval, str, offset + ret, &n)) {
-                                max = i;
-                                break;
-                        }
-                        ret += n;
-                }
-                if (max < min) return false;
-                if (eval(tnext, str, offset + ret, NULL)) {
-                        if (result) *result = ret;
-                        return true;
-                }
-                max--;
-        }
+        int split = nfa_emit(n, NFA_SPLIT);
+        nfa_compile_seq(n, toks, t);
+        int jmp = nfa_emit(n, NFA_JMP);
+        n->states[jmp].x = split;
+        n->states[split].x = split + 1;
+        n->states[split].y = n->len;
 }
 
-static bool
-eval(RegexTok *t, char *str, int offset, int *result)
+static void
+nfa_compile_quest(Nfa *n, RegexTok *toks, int t)
 {
-        if (result) *result = 0;
-        if (t == NULL || offset > (int) strlen(str)) return t == NULL;
+        int split = nfa_emit(n, NFA_SPLIT);
+        nfa_compile_seq(n, toks, t);
+        n->states[split].x = split + 1;
+        n->states[split].y = n->len;
+}
+
+static void
+nfa_compile_tok(Nfa *n, RegexTok *toks, RegexTok *t)
+{
+        int i;
 
         switch (t->type) {
         case START_OF_LINE:
-                if (offset == 0) {
-                        return eval(t->next, str, 0, NULL);
-                } else {
-                        return 0;
-                }
-
+                nfa_emit(n, n->reverse ? NFA_EOL : NFA_BOL);
+                break;
         case END_OF_LINE:
-                return !str[offset];
-
+                nfa_emit(n, n->reverse ? NFA_BOL : NFA_EOL);
+                break;
         case ANY_CHAR:
-                if (eval(t->next, str, offset + 1, NULL)) {
-                        if (result) *result = 1;
-                        return true;
-                } else {
-                        return false;
-                }
-
+                nfa_emit(n, NFA_ANY);
+                break;
         case LITERAL:
-                if (memcmp(str + offset, t->lexeme, strlen(t->lexeme)) == 0) {
-                        if (eval(t->next, str, offset + strlen(t->lexeme), NULL)) {
-                                if (result) *result = strlen(t->lexeme);
-                                return true;
-                        } else {
-                                return false;
-                        }
-                } else {
-                        return false;
+                for (int k = 0; k < t->literal.len; k++) {
+                        i = nfa_emit(n, NFA_CHAR);
+                        n->states[i].c = t->lexeme[n->reverse ? t->literal.len - 1 - k : k];
                 }
-
+                break;
         case BRACKET_EXPR:
-                if (t->bracket_expr.body &&
-                    char_in_str(str[offset], t->bracket_expr.body->lexeme)) {
-                        bool ret = eval(t->next, str, offset + 1, NULL);
-                        if (result) *result = ret ? 1 : 0;
-                        return ret;
-                } else {
-                        return false;
-                }
-
         case BRACKET_EXPR_EXCL:
-                if (!char_in_str(str[offset], t->bracket_expr.body->lexeme)) {
-                        bool ret = eval(t->next, str, offset + 1, NULL);
-                        if (result) *result = ret ? 1 : 0;
-                        return ret;
-                } else {
-                        return 0;
-                }
-
-        case GROUP: {
-                int n;
-                if (eval(t->group.body, str, offset, &n)) {
-                        if (eval(t->next, str, offset + n, NULL)) {
-                                if (result) *result = n;
-                                return true;
-                        }
-                        return false;
-                }
-                return false;
-        }
-
+                i = nfa_emit(n, NFA_CLASS);
+                n->states[i].class = t->bracket_expr.class;
+                break;
+        case GROUP:
+                i = nfa_emit(n, NFA_SAVE);
+                n->states[i].x = 2 * t->group.id;
+                nfa_compile_seq(n, toks, t->group.body);
+                i = nfa_emit(n, NFA_SAVE);
+                n->states[i].x = 2 * t->group.id + 1;
+                break;
         case MATCH_ZERO_MORE:
-                return match_range(t->match_zero_more.match, t->next, str, offset, result, 0, 999);
-
+                nfa_compile_star(n, toks, t->match_zero_more.match);
+                break;
         case MATCH_ZERO_ONE:
-                return match_range(t->match_zero_one.match, t->next, str, offset, result, 0, 1);
-
-        case MATCH_ONE_MORE:
-                return match_range(t->match_one_more.match, t->next, str, offset, result, 1, 999);
-
-        case MATCH_RANGE: {
-                char *start = t->match_range.range->lexeme;
-                int max = 999;
-                char *c;
-                if ((c = strchr(start, ','))) {
-                        *c = 0;
-                        max = c[1] ? atoi(c + 1) : max;
-                }
-                int min = atoi(start);
-                return match_range(t->match_range.match, t->next, str, offset, result, min, max);
+                nfa_compile_quest(n, toks, t->match_zero_one.match);
+                break;
+        case MATCH_ONE_MORE: {
+                int start = n->len;
+                nfa_compile_seq(n, toks, t->match_one_more.match);
+                int split = nfa_emit(n, NFA_SPLIT);
+                n->states[split].x = start;
+                n->states[split].y = split + 1;
+                break;
         }
-
+        case MATCH_RANGE:
+                for (i = 0; i < t->match_range.min; i++)
+                        nfa_compile_seq(n, toks, t->match_range.match);
+                if (t->match_range.max == RANGE_INF)
+                        nfa_compile_star(n, toks, t->match_range.match);
+                for (; i < t->match_range.max; i++)
+                        nfa_compile_quest(n, toks, t->match_range.match);
+                break;
         case MATCH_OR: {
-                int n;
-                if (eval(t->match_or.left, str, offset, &n)) {
-                        if (result) *result = n;
-                        return eval(t->next, str, offset + n, NULL);
-                }
-                if (eval(t->match_or.right, str, offset, &n)) {
-                        if (result) *result = n;
-                        return eval(t->next, str, offset + n, NULL);
-                }
-                return false;
+                int split = nfa_emit(n, NFA_SPLIT);
+                nfa_compile_seq(n, toks, t->match_or.left);
+                int jmp = nfa_emit(n, NFA_JMP);
+                nfa_compile_seq(n, toks, t->match_or.right);
+                n->states[split].x = split + 1;
+                n->states[split].y = jmp + 1;
+                n->states[jmp].x = n->len;
+                break;
         }
-
-        case MATCH_GROUP: // logic for this not implemented
+        case MATCH_GROUP:
         default:
                 todo("case for %s", TOKREPR[t->type]);
         }
 }
 
-bool
-regex_match(Regex expr, char *str)
+static void
+nfa_compile_seq(Nfa *n, RegexTok *toks, int t)
 {
-        int o = 0;
-        if (expr.tokens == NULL) return false;
-        if (expr.tokens->type == START_OF_LINE)
-                return eval(expr.tokens, str, 0, 0);
-        do {
-                if (eval(expr.tokens, str, o, 0)) return true;
-                ++o;
-        } while (str[o]);
-        return false;
+        if (n->reverse) {
+                if (t == NONE) return;
+                nfa_compile_seq(n, toks, toks[t].next);
+                nfa_compile_tok(n, toks, &toks[t]);
+                return;
+        }
+        for (; t != NONE; t = toks[t].next)
+                nfa_compile_tok(n, toks, &toks[t]);
 }
 
-char *
-regex_repr(Regex expr)
+/* Programs are built on the heap and moved to the arena once their size is
+ * known */
+static Nfa *
+nfa_move(Arena *a, Nfa *tmp)
 {
-        return expr.repr;
+        Nfa *n = arena_alloc(a, sizeof(Nfa));
+        n->len = n->cap = tmp->len;
+        n->states = arena_alloc(a, tmp->len * sizeof(NfaState));
+        memcpy(n->states, tmp->states, tmp->len * sizeof(NfaState));
+        free(tmp->states);
+        return n;
+}
+
+static Nfa *
+nfa_compile(Arena *a, RegexTok *toks, int ngroups)
+{
+        Nfa tmp = { 0 };
+        Nfa *n;
+        int i;
+
+        i = nfa_emit(&tmp, NFA_SAVE);
+        tmp.states[i].x = 0;
+        nfa_compile_seq(&tmp, toks, toks ? 0 : NONE);
+        i = nfa_emit(&tmp, NFA_SAVE);
+        tmp.states[i].x = 1;
+        nfa_emit(&tmp, NFA_MATCH);
+        n = nfa_move(a, &tmp);
+        n->nslots = 2 * (ngroups + 1);
+        n->anchored = toks && toks[0].type == START_OF_LINE;
+        return n;
+}
+
+/* The pattern backwards, for patterns that end in $ and can start anywhere:
+ * every match ends at the end of the input, so reading it from there back
+ * finds out in one pass, and a pattern like [.]com$ usually knows after a
+ * few bytes. Groups are there but only for the SAVEs to be skipped. */
+static Nfa *
+nfa_compile_reverse(Arena *a, RegexTok *toks, int ngroups)
+{
+        Nfa tmp = { .reverse = true };
+        Nfa *n;
+
+        nfa_compile_seq(&tmp, toks, 0);
+        nfa_emit(&tmp, NFA_MATCH);
+        n = nfa_move(a, &tmp);
+        n->nslots = 2 * (ngroups + 1);
+        n->anchored = true; /* by the $ */
+        n->reverse = true;
+        return n;
+}
+
+/* Whether toks is worth matching backwards */
+static bool
+ends_in_eol(RegexTok *toks)
+{
+        int t = 0, last = NONE;
+        if (toks == NULL || toks[0].type == START_OF_LINE) return false;
+        for (; t != NONE; t = toks[t].next)
+                last = t;
+        return toks[last].type == END_OF_LINE;
+}
+
+/* One program for all the patterns of a RegexSet, entered through a fan of
+ * SPLITs at pc 0. The MATCH of each pattern holds ids[i] in x. */
+static Nfa *
+nfa_compile_set(Arena *a, RegexTok **toks, int *ids, int count)
+{
+        Nfa tmp = { 0 };
+        Nfa *n;
+        bool anchored = true;
+
+        for (int i = 0; i < count - 1; i++)
+                nfa_emit(&tmp, NFA_SPLIT);
+        for (int i = 0; i < count; i++) {
+                int start = tmp.len;
+                if (i < count - 1) {
+                        tmp.states[i].x = start;
+                        tmp.states[i].y = i + 1;
+                } else if (count > 1) {
+                        tmp.states[count - 2].y = start;
+                }
+                nfa_compile_seq(&tmp, toks[i], 0);
+                int match = nfa_emit(&tmp, NFA_MATCH);
+                tmp.states[match].x = ids[i];
+                anchored = anchored && toks[i][0].type == START_OF_LINE;
+        }
+        n = nfa_move(a, &tmp);
+        n->nslots = 2;
+        n->anchored = anchored;
+        return n;
+}
+
+static struct Dfa *dfa_new(Arena *a, Nfa *n, int npatterns);
+static struct Jit *jit_compile(Arena *a, struct Dfa *d);
+static struct Glushkov *glushkov_compile(Arena *a, RegexTok *toks);
+static struct Counters *counters_new(Arena *a, int ntokens);
+
+/* Prefilter
+ *
+ * A literal that every match has to contain, found on the tokens that can't
+ * be skipped. If the pattern starts with it, matches can only start where it
+ * occurs. Otherwise it only rejects inputs that don't contain it. memchr()
+ * and memmem() do the scanning, libc has vectorized versions of both.
+ */
+typedef struct Prefilter {
+        const char *lit;
+        int len;
+        bool prefix;
+} Prefilter;
+
+static void
+find_required_literal(RegexTok *toks, int i, RegexTok **best)
+{
+        for (; i != NONE; i = toks[i].next) {
+                RegexTok *t = &toks[i];
+                switch (t->type) {
+                case LITERAL:
+                        if (*best == NULL || t->literal.len > (*best)->literal.len)
+                                *best = t;
+                        break;
+                case GROUP:
+                        find_required_literal(toks, t->group.body, best);
+                        break;
+                case MATCH_ONE_MORE:
+                        find_required_literal(toks, t->match_one_more.match, best);
+                        break;
+                case MATCH_RANGE:
+                        if (t->match_range.min > 0)
+                                find_required_literal(toks, t->match_range.match, best);
+                        break;
+                default:
+                        break;
+                }
+        }
+}
+
+static Prefilter *
+prefilter_compile(Arena *a, RegexTok *toks)
+{
+        RegexTok *lit = NULL;
+        Prefilter *p;
+
+        if (toks == NULL) return NULL;
+        if (toks[0].type == LITERAL)
+                lit = &toks[0];
+        else
+                find_required_literal(toks, 0, &lit);
+        if (lit == NULL) return NULL;
+
+        p = arena_alloc(a, sizeof(Prefilter));
+        p->lit = lit->lexeme;
+        p->len = lit->literal.len;
+        p->prefix = lit == &toks[0];
+        return p;
+}
+
+static const char *
+prefilter_find(Prefilter *p, const char *buf, size_t len)
+{
+        if (p->len == 1) return memchr(buf, p->lit[0], len);
+        return memmem(buf, len, p->lit, p->len);
+}
+
+static bool
+has_backrefs(RegexTok *toks, int i)
+{
+        for (; i != NONE; i = toks[i].next) {
+                RegexTok *t = &toks[i];
+                switch (t->type) {
+                case MATCH_GROUP:
+                        return true;
+                case GROUP:
+                        if (has_backrefs(toks, t->group.body)) return true;
+                        break;
+                case MATCH_ZERO_MORE:
+                        if (has_backrefs(toks, t->match_zero_more.match)) return true;
+                        break;
+                case MATCH_ZERO_ONE:
+                        if (has_backrefs(toks, t->match_zero_one.match)) return true;
+                        break;
+                case MATCH_ONE_MORE:
+                        if (has_backrefs(toks, t->match_one_more.match)) return true;
+                        break;
+                case MATCH_RANGE:
+                        if (has_backrefs(toks, t->match_range.match)) return true;
+                        break;
+                case MATCH_OR:
+                        if (has_backrefs(toks, t->match_or.left) ||
+                            has_backrefs(toks, t->match_or.right)) return true;
+                        break;
+                default:
+                        break;
+                }
+        }
+        return false;
+}
+
+/* Length analysis
+ *
+ * How long a match of a token list can be and the bytes a non-empty one can
+ * start with. match_n() skips inputs too short for any match and start
+ * offsets with a byte no match starts with.
+ */
+typedef struct Span {
+        size_t min;
+        size_t max; /* REGEX_UNSET for no limit */
+        RegexClass first;
+} Span;
+
+static Span span_seq(RegexTok *toks, int t);
+
+static size_t
+span_add(size_t a, size_t b)
+{
+        return a == REGEX_UNSET || b == REGEX_UNSET ? REGEX_UNSET : a + b;
+}
+
+static size_t
+span_mul(size_t a, int k)
+{
+        if (k == 0 || a == 0) return 0;
+        return a == REGEX_UNSET || k == RANGE_INF ? REGEX_UNSET : a * k;
+}
+
+static Span
+span_tok(RegexTok *toks, RegexTok *t)
+{
+        Span s = { 0 }, l, r;
+
+        switch (t->type) {
+        case START_OF_LINE:
+        case END_OF_LINE:
+                break;
+        case ANY_CHAR:
+                s.min = s.max = 1;
+                memset(&s.first, 0xff, sizeof s.first);
+                break;
+        case LITERAL:
+                s.min = s.max = t->literal.len;
+                class_add(&s.first, t->lexeme[0]);
+                break;
+        case BRACKET_EXPR:
+        case BRACKET_EXPR_EXCL:
+                s.min = s.max = 1;
+                s.first = *t->bracket_expr.class;
+                break;
+        case GROUP:
+                return span_seq(toks, t->group.body);
+        case MATCH_ZERO_MORE:
+                s = span_seq(toks, t->match_zero_more.match);
+                s.min = 0;
+                s.max = span_mul(s.max, RANGE_INF);
+                break;
+        case MATCH_ZERO_ONE:
+                s = span_seq(toks, t->match_zero_one.match);
+                s.min = 0;
+                break;
+        case MATCH_ONE_MORE:
+                s = span_seq(toks, t->match_one_more.match);
+                s.max = span_mul(s.max, RANGE_INF);
+                break;
+        case MATCH_RANGE:
+                s = span_seq(toks, t->match_range.match);
+                s.min *= t->match_range.min;
+                s.max = span_mul(s.max, t->match_range.max);
+                if (t->match_range.max == 0) s.first = (RegexClass) { 0 };
+                break;
+        case MATCH_OR:
+                l = span_seq(toks, t->match_or.left);
+                r = span_seq(toks, t->match_or.right);
+                s.min = l.min < r.min ? l.min : r.min;
+                s.max = l.max == REGEX_UNSET || r.max == REGEX_UNSET ? REGEX_UNSET
+                        : l.max > r.max ? l.max : r.max;
+                for (int i = 0; i < 4; i++)
+                        s.first.bits[i] = l.first.bits[i] | r.first.bits[i];
+                break;
+        case MATCH_GROUP:
+        default:
+                s.max = REGEX_UNSET;
+                memset(&s.first, 0xff, sizeof s.first);
+                break;
+        }
+        return s;
+}
+
+static Span
+span_seq(RegexTok *toks, int t)
+{
+        Span s = { 0 };
+        for (; t != NONE; t = toks[t].next) {
+                Span x = span_tok(toks, &toks[t]);
+                /* as long as what came before can be empty */
+                if (s.min == 0)
+                        for (int i = 0; i < 4; i++)
+                                s.first.bits[i] |= x.first.bits[i];
+                s.min += x.min;
+                s.max = span_add(s.max, x.max);
+        }
+        return s;
+}
+
+static void
+analyze(Regex *r)
+{
+        Span s;
+
+        r->minlen = 0;
+        r->maxlen = REGEX_UNSET;
+        r->first = NULL;
+        if (r->tokens == NULL) return;
+        s = span_seq(r->tokens, 0);
+        r->minlen = s.min;
+        r->maxlen = s.max;
+        /* skipping bytes would move where ^ matches */
+        for (int i = 0; i < r->ntokens; i++)
+                if (r->tokens[i].type == START_OF_LINE) return;
+        if (s.min == 0) return;
+        r->first = arena_alloc(r->arena, sizeof(RegexClass));
+        *r->first = s.first;
+}
+
+/* The lazy DFAs of r, one per NFA */
+static void
+dfa_attach(Regex *r)
+{
+        r->dfa = dfa_new(r->arena, r->nfa, 0);
+        if (r->rnfa) r->rdfa = dfa_new(r->arena, r->rnfa, 0);
+}
+
+/* regex_compile_flags(), leaving the DFA engine without its lazy DFAs
+ * unless dfa. regex_load() has a whole one in the image */
+static Regex
+compile(char *expr, int flags, bool dfa)
+{
+        Regex r;
+        bool backrefs;
+        r.arena = arena_new();
+        r.repr = arena_alloc(r.arena, strlen(expr) + 1);
+        strcpy(r.repr, expr);
+        get_tokens(&r, expr);
+        r.nfa = NULL;
+        r.dfa = NULL;
+        r.rnfa = NULL;
+        r.rdfa = NULL;
+        r.jit = NULL;
+        r.glushkov = NULL;
+        r.image = NULL;
+        backrefs = r.tokens && has_backrefs(r.tokens, 0);
+        r.engine = flags & (REGEX_BACKTRACK | REGEX_NFA | REGEX_DFA | REGEX_GLUSHKOV);
+        /* short patterns, unless the DFA can read them backwards */
+        if (r.engine == 0 && !backrefs && !(flags & REGEX_JIT) && !ends_in_eol(r.tokens))
+                r.engine = REGEX_GLUSHKOV;
+        if (r.engine == REGEX_GLUSHKOV && (r.glushkov = glushkov_compile(r.arena, r.tokens)) == NULL)
+                r.engine = 0;
+        if (r.engine == 0)
+                r.engine = backrefs ? REGEX_BACKTRACK : REGEX_DFA;
+        /* regex_exec() runs on the NFA whatever the engine is */
+        if (!backrefs || r.engine != REGEX_BACKTRACK)
+                r.nfa = nfa_compile(r.arena, r.tokens, r.ngroups);
+        if ((r.engine == REGEX_NFA || r.engine == REGEX_DFA) && ends_in_eol(r.tokens))
+                r.rnfa = nfa_compile_reverse(r.arena, r.tokens, r.ngroups);
+        if (r.engine == REGEX_DFA && dfa) dfa_attach(&r);
+        /* of the DFA matches run on, built whole up front */
+        if (r.dfa && flags & REGEX_JIT)
+                r.jit = jit_compile(r.arena, r.rdfa ? r.rdfa : r.dfa);
+        r.prefilter = prefilter_compile(r.arena, r.tokens);
+        r.counters = counters_new(r.arena, r.ntokens);
+        analyze(&r);
+        return r;
+}
+
+Regex
+regex_compile_flags(char *expr, int flags)
+{
+        return compile(expr, flags, true);
+}
+
+Regex
+regex_compile(char *expr)
+{
+        return regex_compile_flags(expr, 0);
+}
+
+/* Work a match is allowed to do, see regex_match_limited(). Engines stop
+ * and set exceeded before steps gets past max. */
+typedef struct Budget {
+        uint64_t max;
+        uint64_t steps;
+        bool exceeded;
+} Budget;
+
+#define UNLIMITED ((Budget) { .max = UINT64_MAX })
+
+/* Stats
+ *
+ * Built with REGEX_STATS, matches count what they do in expr.counters with
+ * relaxed atomic adds, so a Regex shared by threads counts the work of all
+ * of them. Otherwise counters is NULL and COUNT() compiles to nothing.
+ */
+typedef struct Counters {
+        _Atomic uint64_t *evals; /* tokens tried by the backtracker, by index */
+        _Atomic uint64_t backtracks;
+        _Atomic uint64_t starts;
+        _Atomic uint64_t prefilter_hits;
+        _Atomic uint64_t prefilter_misses;
+} Counters;
+
+#ifdef REGEX_STATS
+#define COUNT(c, counter) ((c) ? (void) atomic_fetch_add_explicit(&(c)->counter, 1, memory_order_relaxed) : (void) 0)
+#else
+#define COUNT(c, counter) ((void) 0)
+#endif
+
+static Counters *
+counters_new(Arena *a, int ntokens)
+{
+#ifdef REGEX_STATS
+        Counters *c = arena_alloc(a, sizeof(Counters));
+        c->evals = arena_alloc(a, (ntokens + 1) * sizeof *c->evals);
+        return c;
+#else
+        (void) a;
+        (void) ntokens;
+        return NULL;
+#endif
+}
+
+/* Backtracker
+ *
+ * eval() walks the tokens with stacks of its own on the heap, so the C stack
+ * stays as deep whatever the pattern and the input. Tokens that get control
+ * back once what they hold is done, groups, alternations and repetitions,
+ * push a BtFrame, the rest go straight on to their next. A repetition keeps
+ * where each match of its body ends, to back off one at a time, as runs of
+ * matches of the same length: a million `.` are one BtRun.
+ */
+typedef struct BtFrame {
+        enum {
+                BT_GROUP, /* waiting for the body */
+                BT_LEFT,  /* waiting for the left side of | */
+                BT_RIGHT, /* same for the right side */
+                BT_MORE,  /* waiting for one more repetition */
+                BT_REST,  /* waiting for what follows the repetitions */
+        } state;
+        int tok;
+        size_t offset; /* where tok started */
+        size_t count;  /* repetitions */
+        size_t least;  /* fewest repetitions worth going on from */
+        size_t runs;   /* its first run in Eval.runs */
+} BtFrame;
+
+typedef struct BtRun {
+        size_t end; /* of the last repetition in the run */
+        size_t len; /* of every one of them */
+        size_t n;
+} BtRun;
+
+#define REPEAT_INF SIZE_MAX
+
+/* What eval() is matching against */
+typedef struct Eval {
+        RegexTok *toks;
+        const char *str;
+        size_t len;
+        Budget *budget; /* a step per token tried */
+        uint64_t *memo; /* (token, offset) pairs known to fail, or NULL */
+        Counters *counters;
+        BtFrame *frames;
+        size_t nframes, framecap;
+        BtRun *runs;
+        size_t nruns, runcap;
+} Eval;
+
+/* Backtracking memo
+ *
+ * What eval() returns depends on the token and the offset only, so once a
+ * pair fails it fails every time it comes up again. Remembering those in a
+ * bit per pair keeps nested quantifiers from going exponential. Patterns
+ * with nothing to back off from don't need it, and tables bigger than
+ * REGEX_MEMO_SIZE bytes aren't worth it.
+ */
+#ifndef REGEX_MEMO_SIZE
+#define REGEX_MEMO_SIZE (1 << 20)
+#endif
+
+/* Words of memo for matching expr against len bytes, 0 for none */
+static size_t
+memo_words(Regex expr, size_t len)
+{
+        bool backs_off = false;
+        for (int i = 0; i < expr.ntokens && !backs_off; i++) {
+                switch (expr.tokens[i].type) {
+                case MATCH_ZERO_MORE:
+                case MATCH_ZERO_ONE:
+                case MATCH_ONE_MORE:
+                case MATCH_RANGE:
+                case MATCH_OR:
+                        backs_off = true;
+                        break;
+                default:
+                        break;
+                }
+        }
+        if (!backs_off || len >= REGEX_MEMO_SIZE * 8) return 0;
+        size_t bits = (size_t) expr.ntokens * (len + 1);
+        return bits / 8 < REGEX_MEMO_SIZE ? (bits + 63) / 64 : 0;
+}
+
+static bool
+memo_has(Eval *e, int tok, size_t offset)
+{
+        size_t bit = (size_t) tok * (e->len + 1) + offset;
+        return e->memo && e->memo[bit / 64] >> bit % 64 & 1;
+}
+
+static void
+memo_set(Eval *e, int tok, size_t offset)
+{
+        size_t bit = (size_t) tok * (e->len + 1) + offset;
+        if (e->memo) e->memo[bit / 64] |= (uint64_t) 1 << bit % 64;
+}
+
+static BtFrame *
+bt_push(Eval *e, int state, int tok, size_t offset)
+{
+        if (e->nframes == e->framecap) {
+                e->framecap = e->framecap ? e->framecap * 2 : 16;
+                e->frames = realloc(e->frames, e->framecap * sizeof *e->frames);
+        }
+        e->frames[e->nframes] = (BtFrame) { state, tok, offset, 0, 0, e->nruns };
+        return &e->frames[e->nframes++];
+}
+
+/* Where the last repetition of f ends */
+static size_t
+bt_end(Eval *e, BtFrame *f)
+{
+        return e->nruns == f->runs ? f->offset : e->runs[e->nruns - 1].end;
+}
+
+static void
+bt_add_end(Eval *e, BtFrame *f, size_t end)
+{
+        size_t len = end - bt_end(e, f);
+        ++f->count;
+        if (e->nruns > f->runs && e->runs[e->nruns - 1].len == len) {
+                e->runs[e->nruns - 1].end = end;
+                e->runs[e->nruns - 1].n++;
+                return;
+        }
+        if (e->nruns == e->runcap) {
+                e->runcap = e->runcap ? e->runcap * 2 : 16;
+                e->runs = realloc(e->runs, e->runcap * sizeof *e->runs);
+        }
+        e->runs[e->nruns++] = (BtRun) { end, len, 1 };
+}
+
+static void
+bt_drop_end(Eval *e, BtFrame *f)
+{
+        BtRun *r = &e->runs[e->nruns - 1];
+        --f->count;
+        r->end -= r->len;
+        if (--r->n == 0) --e->nruns;
+}
+
+static void
+repeat_bounds(RegexTok *t, int *body, size_t *min, size_t *max)
+{
+        switch (t->type) {
+        case MATCH_ZERO_MORE:
+                *body = t->match_zero_more.match;
+                *min = 0;
+                *max = REPEAT_INF;
+                break;
+        case MATCH_ZERO_ONE:
+                *body = t->match_zero_one.match;
+                *min = 0;
+                *max = 1;
+                break;
+        case MATCH_ONE_MORE:
+                *body = t->match_one_more.match;
+                *min = 1;
+                *max = REPEAT_INF;
+                break;
+        case MATCH_RANGE:
+                *body = t->match_range.match;
+                *min = t->match_range.min;
+                *max = t->match_range.max == RANGE_INF ? REPEAT_INF : (size_t) t->match_range.max;
+                break;
+        default:
+                todo("bounds of %s", TOKREPR[t->type]);
+        }
+}
+
+/* Whether the tokens from i on match at offset. Groups and alternations
+ * stick to the first way their body matches, repetitions match as many
+ * times as they can and back off one at a time until the rest matches. */
+static bool
+eval(Eval *e, int i, size_t offset)
+{
+        Budget *b = e->budget;
+        size_t min, max;
+        RegexTok *t;
+        BtFrame *f;
+        bool ok;
+        int body;
+
+call:
+        if (i == NONE) {
+                ok = true;
+                goto ret;
+        }
+        if (b->steps == b->max) {
+                b->exceeded = true;
+                e->nframes = e->nruns = 0;
+                return false;
+        }
+        ++b->steps;
+        COUNT(e->counters, evals[i]);
+        if (memo_has(e, i, offset)) goto fail;
+
+        t = &e->toks[i];
+        switch (t->type) {
+        case START_OF_LINE:
+                if (offset != 0) goto fail;
+                i = t->next;
+                goto call;
+
+        case END_OF_LINE:
+                if (offset != e->len) goto fail;
+                i = t->next;
+                goto call;
+
+        case ANY_CHAR:
+                if (offset == e->len) goto fail;
+                ++offset;
+                i = t->next;
+                goto call;
+
+        case LITERAL:
+                if (e->len - offset < (size_t) t->literal.len ||
+                    memcmp(e->str + offset, t->lexeme, t->literal.len) != 0)
+                        goto fail;
+                offset += t->literal.len;
+                i = t->next;
+                goto call;
+
+        case BRACKET_EXPR:
+        case BRACKET_EXPR_EXCL:
+                if (offset == e->len || !class_has(t->bracket_expr.class, e->str[offset])) goto fail;
+                ++offset;
+                i = t->next;
+                goto call;
+
+        case GROUP:
+                bt_push(e, BT_GROUP, i, offset);
+                i = t->group.body;
+                goto call;
+
+        case MATCH_OR:
+                bt_push(e, BT_LEFT, i, offset);
+                i = t->match_or.left;
+                goto call;
+
+        case MATCH_ZERO_MORE:
+        case MATCH_ZERO_ONE:
+        case MATCH_ONE_MORE:
+        case MATCH_RANGE:
+                f = bt_push(e, BT_MORE, i, offset);
+                repeat_bounds(t, &body, &min, &max);
+                f->least = min;
+                goto more;
+
+        case MATCH_GROUP: // logic for this not implemented
+        default:
+                todo("case for %s", TOKREPR[t->type]);
+        }
+
+fail:
+        ok = false;
+ret:
+        /* offset is where the tokens that returned ended if ok */
+        if (e->nframes == 0) return ok;
+        f = &e->frames[e->nframes - 1];
+        t = &e->toks[f->tok];
+        switch (f->state) {
+        case BT_GROUP:
+        case BT_RIGHT:
+                if (!ok) goto pop;
+                --e->nframes;
+                i = t->next;
+                goto call;
+
+        case BT_LEFT:
+                if (ok) {
+                        --e->nframes;
+                        i = t->next;
+                        goto call;
+                }
+                f->state = BT_RIGHT;
+                i = t->match_or.right;
+                offset = f->offset;
+                goto call;
+
+        case BT_MORE:
+                if (!ok) goto rest;
+                if (offset == bt_end(e, f)) {
+                        /* the ones left would match empty here too */
+                        bt_add_end(e, f, offset);
+                        if (f->count < f->least) f->least = f->count;
+                        goto rest;
+                }
+                bt_add_end(e, f, offset);
+                goto more;
+
+        case BT_REST:
+                if (ok) {
+                        e->nruns = f->runs;
+                        --e->nframes;
+                        goto ret;
+                }
+                if (f->count == f->least) goto pop;
+                COUNT(e->counters, backtracks);
+                bt_drop_end(e, f);
+                goto rest;
+        }
+
+more:
+        repeat_bounds(t, &body, &min, &max);
+        if (f->count < max) {
+                f->state = BT_MORE;
+                i = body;
+                offset = bt_end(e, f);
+                goto call;
+        }
+rest:
+        if (f->count < f->least) goto pop;
+        f->state = BT_REST;
+        i = t->next;
+        offset = bt_end(e, f);
+        goto call;
+pop:
+        memo_set(e, f->tok, f->offset);
+        e->nruns = f->runs;
+        --e->nframes;
+        goto fail;
+}
+
+typedef struct NfaList {
+        int *pcs;
+        int n;
+} NfaList;
+
+typedef struct NfaScratch {
+        NfaList clist, nlist;
+        unsigned *mark;
+        unsigned gen;
+        int *stack;
+} NfaScratch;
+
+/* Bytes of zeroed memory nfa_scratch_init() needs */
+static size_t
+nfa_scratch_size(Nfa *n)
+{
+        return (2 * n->len + 2 * n->len + 1) * sizeof(int) + n->len * sizeof(unsigned);
+}
+
+static void
+nfa_scratch_init(NfaScratch *s, Nfa *n, void *mem)
+{
+        s->mark = mem;
+        s->clist.pcs = (int *) (s->mark + n->len);
+        s->nlist.pcs = s->clist.pcs + n->len;
+        s->stack = s->nlist.pcs + n->len;
+        s->gen = 0;
+}
+
+/* Add pc and its epsilon closure to l. bol and eol tell if the position is
+ * the start or the end of the input. EOL states that can't pass yet and MATCH
+ * are kept in the list too. Returns true if MATCH is reachable. Callers bump
+ * s->gen once per list they build. */
+static bool
+nfa_add(Nfa *n, NfaScratch *s, NfaList *l, int pc, bool bol, bool eol)
+{
+        bool matched = false;
+        int sp = 0;
+
+        s->stack[sp++] = pc;
+        while (sp) {
+                pc = s->stack[--sp];
+                if (s->mark[pc] == s->gen) continue;
+                s->mark[pc] = s->gen;
+
+                NfaState *st = &n->states[pc];
+                switch (st->op) {
+                case NFA_JMP:
+                        s->stack[sp++] = st->x;
+                        break;
+                case NFA_SPLIT:
+                        s->stack[sp++] = st->y;
+                        s->stack[sp++] = st->x;
+                        break;
+                case NFA_SAVE:
+                        s->stack[sp++] = pc + 1;
+                        break;
+                case NFA_BOL:
+                        if (bol) s->stack[sp++] = pc + 1;
+                        break;
+                case NFA_EOL:
+                        if (eol)
+                                s->stack[sp++] = pc + 1;
+                        else
+                                l->pcs[l->n++] = pc;
+                        break;
+                case NFA_MATCH:
+                        matched = true;
+                        l->pcs[l->n++] = pc;
+                        break;
+                default:
+                        l->pcs[l->n++] = pc;
+                        break;
+                }
+        }
+        return matched;
+}
+
+static bool
+nfa_step_accepts(NfaState *st, unsigned char c)
+{
+        switch (st->op) {
+        case NFA_CHAR:
+                return st->c == c;
+        case NFA_ANY:
+                return true;
+        case NFA_CLASS:
+                return class_has(st->class, c);
+        default:
+                return false;
+        }
+}
+
+/* A step per byte, plus one per state stepped on it. s can be reused for
+ * the next input. */
+static bool
+nfa_run(Nfa *n, NfaScratch *sp, const char *buf, size_t len, Budget *b)
+{
+        NfaScratch s = *sp;
+        NfaList tmp;
+        bool matched = false;
+
+        s.clist.n = 0;
+        ++s.gen;
+        if (nfa_add(n, &s, &s.clist, 0, true, len == 0)) {
+                matched = true;
+                goto done;
+        }
+
+        for (size_t pos = 0; pos < len; pos++) {
+                uint64_t cost = s.clist.n + 1;
+                if (b->max - b->steps < cost) {
+                        b->exceeded = true;
+                        break;
+                }
+                b->steps += cost;
+                s.nlist.n = 0;
+                ++s.gen;
+                for (int i = 0; i < s.clist.n; i++) {
+                        int pc = s.clist.pcs[i];
+                        if (nfa_step_accepts(&n->states[pc], nfa_byte(n, buf, len, pos)) &&
+                            nfa_add(n, &s, &s.nlist, pc + 1, false, pos + 1 == len)) {
+                                matched = true;
+                                goto done;
+                        }
+                }
+                if (!n->anchored && nfa_add(n, &s, &s.nlist, 0, false, pos + 1 == len)) {
+                        matched = true;
+                        goto done;
+                }
+                tmp = s.clist;
+                s.clist = s.nlist;
+                s.nlist = tmp;
+                if (s.clist.n == 0 && n->anchored) break;
+        }
+
+done:
+        sp->gen = s.gen;
+        return matched;
+}
+
+static bool
+nfa_match(Nfa *n, const char *buf, size_t len, Budget *b)
+{
+        NfaScratch s;
+        void *mem = calloc(1, nfa_scratch_size(n));
+        bool matched;
+
+        nfa_scratch_init(&s, n, mem);
+        matched = nfa_run(n, &s, buf, len, b);
+        free(mem);
+        return matched;
+}
+
+/* Pike VM
+ *
+ * Same simulation as nfa_match(), but every thread carries its capture
+ * slots. Threads are kept in priority order and a pc is only added once per
+ * step, by the thread that gets there first, so the result is the one a
+ * backtracker would find and the cost stays O(pattern * input).
+ */
+typedef struct PikeList {
+        int *pcs;
+        int n;
+        size_t *caps; /* nslots per pc, the ones of the thread at that pc */
+} PikeList;
+
+typedef struct PikeFrame {
+        int pc; /* -1: restore caps[slot] to val */
+        int slot;
+        size_t val;
+} PikeFrame;
+
+typedef struct Pike {
+        Nfa *nfa;
+        const char *buf;
+        size_t len;
+        PikeList clist, nlist;
+        unsigned *mark;
+        unsigned gen;
+        PikeFrame *stack;
+        size_t *caps; /* the slots of the thread being added */
+} Pike;
+
+static void *
+pike_init(Pike *vm, Nfa *n, const char *buf, size_t len)
+{
+        size_t ncaps = (size_t) n->len * n->nslots;
+        char *mem = calloc(1, n->len * sizeof(unsigned) +
+                                      2 * n->len * sizeof(int) +
+                                      (2 * ncaps + n->nslots) * sizeof(size_t) +
+                                      (2 * n->len + 1) * sizeof(PikeFrame));
+
+        vm->nfa = n;
+        vm->buf = buf;
+        vm->len = len;
+        vm->stack = (PikeFrame *) mem;
+        vm->clist.caps = (size_t *) (vm->stack + 2 * n->len + 1);
+        vm->nlist.caps = vm->clist.caps + ncaps;
+        vm->caps = vm->nlist.caps + ncaps;
+        vm->mark = (unsigned *) (vm->caps + n->nslots);
+        vm->clist.pcs = (int *) (vm->mark + n->len);
+        vm->nlist.pcs = vm->clist.pcs + n->len;
+        vm->gen = 0;
+        return mem;
+}
+
+/* Add the thread at pc with slots vm->caps to l, following epsilons in
+ * priority order. vm->caps is left as it was. */
+static void
+pike_add(Pike *vm, PikeList *l, int pc, size_t pos)
+{
+        Nfa *n = vm->nfa;
+        int sp = 0;
+
+        vm->stack[sp++] = (PikeFrame) { .pc = pc };
+        while (sp) {
+                PikeFrame f = vm->stack[--sp];
+                if (f.pc < 0) {
+                        vm->caps[f.slot] = f.val;
+                        continue;
+                }
+                pc = f.pc;
+                if (vm->mark[pc] == vm->gen) continue;
+                vm->mark[pc] = vm->gen;
+
+                NfaState *st = &n->states[pc];
+                switch (st->op) {
+                case NFA_JMP:
+                        vm->stack[sp++] = (PikeFrame) { .pc = st->x };
+                        break;
+                case NFA_SPLIT:
+                        vm->stack[sp++] = (PikeFrame) { .pc = st->y };
+                        vm->stack[sp++] = (PikeFrame) { .pc = st->x };
+                        break;
+                case NFA_BOL:
+                        if (pos == 0) vm->stack[sp++] = (PikeFrame) { .pc = pc + 1 };
+                        break;
+                case NFA_EOL:
+                        if (pos == vm->len) vm->stack[sp++] = (PikeFrame) { .pc = pc + 1 };
+                        break;
+                case NFA_SAVE:
+                        if (st->x >= n->nslots) {
+                                vm->stack[sp++] = (PikeFrame) { .pc = pc + 1 };
+                                break;
+                        }
+                        vm->stack[sp++] = (PikeFrame) { -1, st->x, vm->caps[st->x] };
+                        vm->stack[sp++] = (PikeFrame) { .pc = pc + 1 };
+                        vm->caps[st->x] = pos;
+                        break;
+                default:
+                        l->pcs[l->n++] = pc;
+                        memcpy(l->caps + (size_t) pc * n->nslots, vm->caps,
+                               n->nslots * sizeof(size_t));
+                        break;
+                }
+        }
+}
+
+/* Leftmost-first match starting at or after start. Fills the first ncaps
+ * slots of caps on success. */
+static bool
+pike_exec(Nfa *n, const char *buf, size_t len, size_t start, size_t *caps, int ncaps)
+{
+        Pike vm;
+        PikeList tmp;
+        bool matched = false;
+        void *mem = pike_init(&vm, n, buf, len);
+
+        vm.clist.n = 0;
+        ++vm.gen;
+        for (int i = 0; i < n->nslots; i++) vm.caps[i] = REGEX_UNSET;
+        pike_add(&vm, &vm.clist, 0, start);
+
+        for (size_t pos = start;; pos++) {
+                vm.nlist.n = 0;
+                ++vm.gen;
+                for (int i = 0; i < vm.clist.n; i++) {
+                        int pc = vm.clist.pcs[i];
+                        size_t *tcaps = vm.clist.caps + (size_t) pc * n->nslots;
+                        if (n->states[pc].op == NFA_MATCH) {
+                                for (int k = 0; k < ncaps; k++)
+                                        caps[k] = k < n->nslots ? tcaps[k] : REGEX_UNSET;
+                                matched = true;
+                                /* the threads left have lower priority */
+                                break;
+                        }
+                        if (pos < len && nfa_step_accepts(&n->states[pc], buf[pos])) {
+                                memcpy(vm.caps, tcaps, n->nslots * sizeof(size_t));
+                                pike_add(&vm, &vm.nlist, pc + 1, pos + 1);
+                        }
+                }
+                if (pos == len) break;
+                /* a later start is worse than any match found so far */
+                if (!matched && !n->anchored) {
+                        for (int i = 0; i < n->nslots; i++) vm.caps[i] = REGEX_UNSET;
+                        pike_add(&vm, &vm.nlist, 0, pos + 1);
+                }
+                tmp = vm.clist;
+                vm.clist = vm.nlist;
+                vm.nlist = tmp;
+                if (vm.clist.n == 0 && (matched || n->anchored)) break;
+        }
+
+        free(mem);
+        return matched;
+}
+
+/* Lazy DFA
+ *
+ * Each DFA state is a sorted set of NFA states, built the first time the
+ * search needs it and cached with its 256 transitions. The cache of every
+ * Regex is capped at REGEX_DFA_CACHE_SIZE bytes.
+ *
+ * Searches share the cache. They read transitions with atomic loads and take
+ * d->lock only to add a state. Once the cache is full, searches that need a
+ * new state finish on the NFA, and the next search to start flushes the cache
+ * while it holds d->flush exclusively.
+ */
+#ifndef REGEX_DFA_CACHE_SIZE
+#define REGEX_DFA_CACHE_SIZE (1 << 20)
+#endif
+
+#define DFA_UNKNOWN -1
+#define DFA_FULL -2
+
+enum {
+        DFA_MATCH = 1 << 0,        /* an NFA MATCH is in the set */
+        DFA_MATCH_AT_END = 1 << 1, /* matches if the input ends here */
+        DFA_DEAD = 1 << 2,         /* nothing can match from here */
+};
+
+typedef struct DfaState {
+        int *pcs;
+        int npcs;
+        unsigned hash;
+        int flags;
+        uint64_t *match;        /* RegexSet only, patterns matched here */
+        uint64_t *match_at_end; /* and the ones that match if the input ends */
+        _Atomic int next[256];
+} DfaState;
+
+typedef struct Dfa {
+        Nfa *nfa;
+        DfaState *states;
+        int nstates;
+        int maxstates;
+        int *pool; /* pcs of every state, nfa->len per state at most */
+        size_t poolused;
+        int nwords;     /* of the match bitsets, 0 if there are none */
+        uint64_t *sets; /* match bitsets, 2 * nwords per state */
+        int *table; /* open addressing hash of state indices */
+        int tablemask;
+        _Atomic int start;
+        atomic_bool full;
+        _Atomic int flushes; /* read by regex_stats() while others match */
+        NfaScratch s;
+        pthread_mutex_t lock;   /* adding states, guards everything above */
+        pthread_rwlock_t flush; /* shared by searches, exclusive to flush */
+} Dfa;
+
+/* npatterns is the number of MATCH ids to keep track of for a RegexSet, 0
+ * for a single Regex */
+static Dfa *
+dfa_new(Arena *a, Nfa *n, int npatterns)
+{
+        Dfa *d = arena_alloc(a, sizeof(Dfa));
+        int nwords = (npatterns + 63) / 64;
+        size_t per_state = sizeof(DfaState) + 2 * sizeof(int) + n->len * sizeof(int) +
+                           2 * nwords * sizeof(uint64_t);
+        pthread_rwlockattr_t attr;
+        int tablesize = 1;
+
+        d->nfa = n;
+        d->maxstates = REGEX_DFA_CACHE_SIZE / per_state;
+        if (d->maxstates < 8) d->maxstates = 8;
+        while (tablesize < 2 * d->maxstates) tablesize <<= 1;
+        d->tablemask = tablesize - 1;
+        d->states = arena_alloc(a, d->maxstates * sizeof(DfaState));
+        d->pool = arena_alloc(a, (size_t) d->maxstates * n->len * sizeof(int));
+        d->table = arena_alloc(a, tablesize * sizeof(int));
+        d->nwords = nwords;
+        if (nwords)
+                d->sets = arena_alloc(a, (size_t) d->maxstates * 2 * nwords * sizeof(uint64_t));
+        memset(d->table, 0xff, tablesize * sizeof(int));
+        atomic_init(&d->start, DFA_UNKNOWN);
+        atomic_init(&d->full, false);
+        nfa_scratch_init(&d->s, n, arena_alloc(a, nfa_scratch_size(n)));
+
+        pthread_mutex_init(&d->lock, NULL);
+        pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+        /* don't let a stream of searches starve the flush */
+        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+        pthread_rwlock_init(&d->flush, &attr);
+        pthread_rwlockattr_destroy(&attr);
+        return d;
+}
+
+static void
+dfa_flush(Dfa *d)
+{
+        pthread_rwlock_wrlock(&d->flush);
+        if (atomic_load(&d->full)) {
+                d->nstates = 0;
+                d->poolused = 0;
+                memset(d->table, 0xff, (d->tablemask + 1) * sizeof(int));
+                atomic_store(&d->start, DFA_UNKNOWN);
+                atomic_fetch_add_explicit(&d->flushes, 1, memory_order_relaxed);
+                atomic_store(&d->full, false);
+        }
+        pthread_rwlock_unlock(&d->flush);
+}
+
+static int
+cmp_int(const void *a, const void *b)
+{
+        return *(const int *) a - *(const int *) b;
+}
+
+static unsigned
+hash_pcs(int *pcs, int n)
+{
+        unsigned h = 2166136261u;
+        for (int i = 0; i < n; i++)
+                h = (h ^ pcs[i]) * 16777619u;
+        return h;
+}
+
+static inline void
+set_bit(uint64_t *set, int i)
+{
+        set[i >> 6] |= (uint64_t) 1 << (i & 63);
+}
+
+/* Flags of st, made of l, which is sorted. Fills the match bitsets of st
+ * too if there are any. */
+static int
+dfa_state_flags(Dfa *d, DfaState *st, NfaList *l)
+{
+        Nfa *n = d->nfa;
+        NfaList end = { .pcs = d->s.nlist.pcs, .n = 0 };
+        int flags = 0;
+
+        if (l->n == 0 && n->anchored) return DFA_DEAD;
+        for (int i = 0; i < l->n; i++) {
+                NfaState *ns = &n->states[l->pcs[i]];
+                switch (ns->op) {
+                case NFA_MATCH:
+                        flags |= DFA_MATCH | DFA_MATCH_AT_END;
+                        if (st->match) {
+                                set_bit(st->match, ns->x);
+                                set_bit(st->match_at_end, ns->x);
+                        }
+                        break;
+                case NFA_EOL:
+                        ++d->s.gen;
+                        if (nfa_add(n, &d->s, &end, l->pcs[i] + 1, false, true)) {
+                                flags |= DFA_MATCH_AT_END;
+                                for (int k = 0; st->match && k < end.n; k++)
+                                        if (n->states[end.pcs[k]].op == NFA_MATCH)
+                                                set_bit(st->match_at_end, n->states[end.pcs[k]].x);
+                        }
+                        end.n = 0;
+                        break;
+                default:
+                        break;
+                }
+        }
+        return flags;
+}
+
+/* Index of the state made of l, adding it if it is new. DFA_FULL if there
+ * is no room for it. Called with d->lock held. */
+static int
+dfa_state(Dfa *d, NfaList *l)
+{
+        qsort(l->pcs, l->n, sizeof(int), cmp_int);
+        unsigned h = hash_pcs(l->pcs, l->n);
+        int i, slot;
+
+        for (slot = h & d->tablemask; (i = d->table[slot]) != DFA_UNKNOWN;
+             slot = (slot + 1) & d->tablemask) {
+                DfaState *st = &d->states[i];
+                if (st->hash == h && st->npcs == l->n &&
+                    memcmp(st->pcs, l->pcs, l->n * sizeof(int)) == 0)
+                        return i;
+        }
+
+        if (d->nstates == d->maxstates) {
+                atomic_store(&d->full, true);
+                return DFA_FULL;
+        }
+
+        i = d->nstates++;
+        DfaState *st = &d->states[i];
+        st->pcs = d->pool + d->poolused;
+        st->npcs = l->n;
+        st->hash = h;
+        memcpy(st->pcs, l->pcs, l->n * sizeof(int));
+        d->poolused += l->n;
+        st->match = st->match_at_end = NULL;
+        if (d->nwords) {
+                st->match = d->sets + (size_t) i * 2 * d->nwords;
+                st->match_at_end = st->match + d->nwords;
+                memset(st->match, 0, 2 * d->nwords * sizeof(uint64_t));
+        }
+        st->flags = dfa_state_flags(d, st, l);
+        for (int c = 0; c < 256; c++)
+                atomic_store_explicit(&st->next[c], DFA_UNKNOWN, memory_order_relaxed);
+        d->table[slot] = i;
+        return i;
+}
+
+static int
+dfa_start(Dfa *d)
+{
+        int start = atomic_load_explicit(&d->start, memory_order_acquire);
+        if (start != DFA_UNKNOWN) return start;
+
+        pthread_mutex_lock(&d->lock);
+        if ((start = atomic_load(&d->start)) == DFA_UNKNOWN) {
+                d->s.clist.n = 0;
+                ++d->s.gen;
+                nfa_add(d->nfa, &d->s, &d->s.clist, 0, true, false);
+                start = dfa_state(d, &d->s.clist);
+                if (start >= 0)
+                        atomic_store_explicit(&d->start, start, memory_order_release);
+        }
+        pthread_mutex_unlock(&d->lock);
+        return start;
+}
+
+static int
+dfa_next(Dfa *d, int from, unsigned char c)
+{
+        Nfa *n = d->nfa;
+        DfaState *st = &d->states[from];
+        NfaList *l = &d->s.clist;
+        int to;
+
+        pthread_mutex_lock(&d->lock);
+        /* someone else may have been faster */
+        if ((to = atomic_load(&st->next[c])) != DFA_UNKNOWN) goto done;
+
+        l->n = 0;
+        ++d->s.gen;
+        for (int i = 0; i < st->npcs; i++) {
+                int pc = st->pcs[i];
+                if (nfa_step_accepts(&n->states[pc], c))
+                        nfa_add(n, &d->s, l, pc + 1, false, false);
+        }
+        if (!n->anchored)
+                nfa_add(n, &d->s, l, 0, false, false);
+
+        to = dfa_state(d, l);
+        if (to >= 0)
+                atomic_store_explicit(&st->next[c], to, memory_order_release);
+done:
+        pthread_mutex_unlock(&d->lock);
+        return to;
+}
+
+static bool
+dfa_match(Dfa *d, const char *buf, size_t len, Budget *b)
+{
+        const unsigned char *c = (const unsigned char *) buf;
+        /* at walks buf backwards by wrapping around for a reverse program */
+        size_t at = d->nfa->reverse ? len - 1 : 0, step = d->nfa->reverse ? (size_t) -1 : 1;
+        size_t pos = 0, end = len;
+        bool matched;
+        int s, flags;
+
+        /* a step per byte, scan up to the budget and stop there */
+        if (b->max - b->steps < len) end = b->max - b->steps;
+
+        if (atomic_load_explicit(&d->full, memory_order_relaxed))
+                dfa_flush(d);
+
+        pthread_rwlock_rdlock(&d->flush);
+        s = dfa_start(d);
+        for (;;) {
+                if (s == DFA_FULL) {
+                        pthread_rwlock_unlock(&d->flush);
+                        b->steps += pos;
+                        return nfa_match(d->nfa, buf, len, b);
+                }
+                flags = d->states[s].flags;
+                if (flags & (DFA_MATCH | DFA_DEAD) || pos == end) break;
+                int next = atomic_load_explicit(&d->states[s].next[c[at]], memory_order_acquire);
+                if (next == DFA_UNKNOWN)
+                        next = dfa_next(d, s, c[at]);
+                s = next;
+                at += step;
+                ++pos;
+        }
+        pthread_rwlock_unlock(&d->flush);
+        b->steps += pos;
+
+        if (flags & DFA_MATCH) matched = true;
+        else if (flags & DFA_DEAD) matched = false;
+        else if (end != len) matched = false, b->exceeded = true;
+        else matched = flags & DFA_MATCH_AT_END;
+        return matched;
+}
+
+/* Inputs dfa_match_batch() leaves to the caller, the cache filled up */
+#define DFA_RETRY 2
+
+#define DFA_LANES 4
+
+typedef struct DfaLane {
+        const unsigned char *c;
+        size_t at; /* next byte, walking back by wrapping for a reverse program */
+        size_t left;
+        size_t i; /* input, REGEX_UNSET if the lane is idle */
+        int s;
+} DfaLane;
+
+typedef struct DfaBatch {
+        Dfa *d;
+        int start;
+        const char **bufs;
+        const size_t *lens;
+        const size_t *starts;
+        uint8_t *results;
+        size_t n, next;
+} DfaBatch;
+
+/* Gives the next input that needs the DFA to l, false if there are none */
+static bool
+dfa_lane_fill(DfaBatch *bt, DfaLane *l)
+{
+        while (bt->next < bt->n) {
+                size_t i = bt->next++, o = bt->starts[i];
+                if (o == REGEX_UNSET) {
+                        bt->results[i] = false;
+                        continue;
+                }
+                if (bt->start == DFA_FULL) {
+                        bt->results[i] = DFA_RETRY;
+                        continue;
+                }
+                l->c = (const unsigned char *) bt->bufs[i] + o;
+                l->left = bt->lens[i] - o;
+                l->at = bt->d->nfa->reverse ? l->left - 1 : 0;
+                l->i = i;
+                l->s = bt->start;
+                return true;
+        }
+        l->i = REGEX_UNSET;
+        return false;
+}
+
+/* dfa_match() of n inputs with no budget, from starts[i] on or not at all
+ * if it's REGEX_UNSET. DFA_LANES inputs are walked at once a byte of each
+ * at a time, so the transitions of one are loaded while the others are. */
+static void
+dfa_match_batch(Dfa *d, const char **bufs, const size_t *lens, const size_t *starts, size_t n, uint8_t *results)
+{
+        DfaBatch bt = { d, DFA_UNKNOWN, bufs, lens, starts, results, n, 0 };
+        size_t step = d->nfa->reverse ? (size_t) -1 : 1;
+        DfaLane lanes[DFA_LANES];
+        int live = 0;
+
+        if (atomic_load_explicit(&d->full, memory_order_relaxed))
+                dfa_flush(d);
+
+        pthread_rwlock_rdlock(&d->flush);
+        bt.start = dfa_start(d);
+        for (int k = 0; k < DFA_LANES; k++)
+                live += dfa_lane_fill(&bt, &lanes[k]);
+        while (live > 0) {
+                for (int k = 0; k < DFA_LANES; k++) {
+                        DfaLane *l = &lanes[k];
+                        int flags, next;
+                        if (l->i == REGEX_UNSET) continue;
+                        flags = d->states[l->s].flags;
+                        if (flags & (DFA_MATCH | DFA_DEAD) || l->left == 0) {
+                                results[l->i] = flags & DFA_MATCH || (flags & DFA_MATCH_AT_END && !(flags & DFA_DEAD));
+                                live -= !dfa_lane_fill(&bt, l);
+                                continue;
+                        }
+                        next = atomic_load_explicit(&d->states[l->s].next[l->c[l->at]], memory_order_acquire);
+                        if (next == DFA_UNKNOWN)
+                                next = dfa_next(d, l->s, l->c[l->at]);
+                        if (next == DFA_FULL) {
+                                results[l->i] = DFA_RETRY;
+                                live -= !dfa_lane_fill(&bt, l);
+                                continue;
+                        }
+                        l->s = next;
+                        l->at += step;
+                        --l->left;
+                }
+        }
+        pthread_rwlock_unlock(&d->flush);
+}
+
+/* Builds every state of d and returns the start one, or DFA_FULL if they
+ * don't all fit. Only for a Dfa nothing else is using yet. */
+static int
+dfa_build(Dfa *d)
+{
+        int start = dfa_start(d);
+
+        /* states are added at the end, so this reaches all of them */
+        for (int st = 0; start >= 0 && st < d->nstates && !atomic_load(&d->full); st++) {
+                if (d->states[st].flags & (DFA_MATCH | DFA_DEAD)) continue;
+                for (int b = 0; b < 256 && dfa_next(d, st, b) >= 0; b++)
+                        ;
+        }
+        return atomic_load(&d->full) ? DFA_FULL : start;
+}
+
+/* JIT
+ *
+ * The whole DFA of a REGEX_JIT pattern is built when it's compiled and
+ * turned into x86-64 code, a label per state like regex_codegen() writes
+ * but in machine code, in a page of its own that is mapped executable once
+ * it's written. The function takes the input in rdi and its end in rsi and
+ * only touches scratch registers, so it needs no frame.
+ *
+ * A state compares the byte with its few ranges inline, or jumps through a
+ * table of 256 offsets if it has many. A state that loops on a set of at
+ * least JIT_SKIP_MIN bytes made of a few ranges, like the one of `[a-z]*`,
+ * first skips them 16 at a time with SSE2. The program of a pattern that
+ * ends in `$` reads the input backwards, a byte at a time.
+ *
+ * Anywhere else, or if the DFA doesn't fit in its cache, jit is NULL and
+ * the DFA is interpreted.
+ */
+#ifdef HAVE_JIT
+
+#define JIT_INLINE_MAX 8 /* ranges compared inline, more go to a table */
+#define JIT_SKIP_MIN 32  /* bytes a self loop needs to be skipped with SSE2 */
+#define JIT_SKIP_MAX 4   /* and ranges it can have at most */
+
+typedef struct Jit {
+        bool (*fn)(const unsigned char *p, const unsigned char *end);
+        bool reverse; /* p starts at the end of the input, end at its start */
+        void *code;
+        size_t size;
+} Jit;
+
+/* A rel32 in the code, to point at target once it's known */
+typedef struct JitFixup {
+        size_t pos;
+        size_t base; /* what the offset is from */
+        int target;  /* a state, or -1 - k for the constant of byte k */
+} JitFixup;
+
+typedef struct JitAsm {
+        unsigned char *buf;
+        size_t len, cap;
+        size_t *labels; /* of every state */
+        JitFixup *fixups;
+        int nfixups, fixcap;
+        int consts[256]; /* slot of the 16 copies of each byte, -1 if unused */
+        unsigned char pool[256]; /* the byte of each slot */
+        int nconsts;
+} JitAsm;
+
+typedef struct JitRange {
+        int lo, hi;
+        int target;
+} JitRange;
+
+static void
+jit_bytes(JitAsm *a, const void *bytes, size_t n)
+{
+        if (a->len + n > a->cap) {
+                while (a->len + n > a->cap)
+                        a->cap = a->cap ? a->cap * 2 : 4096;
+                a->buf = realloc(a->buf, a->cap);
+        }
+        memcpy(a->buf + a->len, bytes, n);
+        a->len += n;
+}
+
+#define JIT(a, ...) jit_bytes(a, (unsigned char[]) { __VA_ARGS__ }, sizeof((unsigned char[]) { __VA_ARGS__ }))
+
+static void
+jit_u32(JitAsm *a, uint32_t x)
+{
+        JIT(a, x, x >> 8, x >> 16, x >> 24);
+}
+
+static void
+jit_patch(JitAsm *a, size_t pos, size_t to, size_t base)
+{
+        uint32_t x = (uint32_t) (to - base);
+        memcpy(a->buf + pos, &x, 4);
+}
+
+/* A rel32 to target, from base */
+static void
+jit_ref(JitAsm *a, int target, size_t base)
+{
+        if (a->nfixups == a->fixcap) {
+                a->fixcap = a->fixcap ? a->fixcap * 2 : 256;
+                a->fixups = realloc(a->fixups, a->fixcap * sizeof *a->fixups);
+        }
+        a->fixups[a->nfixups++] = (JitFixup) { a->len, base, target };
+        jit_u32(a, 0);
+}
+
+/* A rel32 at the end of an instruction, jumping to state st */
+static void
+jit_jump(JitAsm *a, int st)
+{
+        jit_ref(a, st, a->len + 4);
+}
+
+/* A rip-relative operand at the end of an instruction, the 16 copies of c */
+static void
+jit_const(JitAsm *a, unsigned char c)
+{
+        if (a->consts[c] < 0) {
+                a->pool[a->nconsts] = c;
+                a->consts[c] = a->nconsts++;
+        }
+        jit_ref(a, -1 - c, a->len + 4);
+}
+
+/* Skips the bytes of the self loop of a state, made of ranges, while at
+ * least 16 are left */
+static void
+jit_skip(JitAsm *a, JitRange *ranges, int n)
+{
+        size_t loop = a->len, scalar;
+
+        JIT(a, 0x48, 0x89, 0xf0);             /* mov rax, rsi */
+        JIT(a, 0x48, 0x29, 0xf8);             /* sub rax, rdi */
+        JIT(a, 0x48, 0x83, 0xf8, 0x10);       /* cmp rax, 16 */
+        JIT(a, 0x0f, 0x82);                   /* jb scalar */
+        scalar = a->len;
+        jit_u32(a, 0);
+        JIT(a, 0xf3, 0x0f, 0x6f, 0x07);       /* movdqu xmm0, [rdi] */
+        for (int i = 0; i < n; i++) {
+                /* c - lo <= hi - lo, unsigned, as min(c - lo, hi - lo) == c - lo */
+                JIT(a, 0x66, 0x0f, 0x6f, 0xc8); /* movdqa xmm1, xmm0 */
+                if (ranges[i].lo) {
+                        JIT(a, 0x66, 0x0f, 0xf8, 0x0d); /* psubb xmm1, lo */
+                        jit_const(a, ranges[i].lo);
+                }
+                JIT(a, 0x66, 0x0f, 0x6f, 0xd1); /* movdqa xmm2, xmm1 */
+                JIT(a, 0x66, 0x0f, 0xda, 0x15); /* pminub xmm2, hi - lo */
+                jit_const(a, ranges[i].hi - ranges[i].lo);
+                JIT(a, 0x66, 0x0f, 0x74, 0xd1); /* pcmpeqb xmm2, xmm1 */
+                if (i == 0)
+                        JIT(a, 0x66, 0x0f, 0x6f, 0xda); /* movdqa xmm3, xmm2 */
+                else
+                        JIT(a, 0x66, 0x0f, 0xeb, 0xda); /* por xmm3, xmm2 */
+        }
+        JIT(a, 0x66, 0x0f, 0xd7, 0xc3);       /* pmovmskb eax, xmm3 */
+        JIT(a, 0x3d, 0xff, 0xff, 0x00, 0x00); /* cmp eax, 0xffff */
+        JIT(a, 0x75, 0x09);                   /* jne found */
+        JIT(a, 0x48, 0x83, 0xc7, 0x10);       /* add rdi, 16 */
+        JIT(a, 0xe9);                         /* jmp loop */
+        jit_u32(a, (uint32_t) (loop - (a->len + 4)));
+        JIT(a, 0xf7, 0xd0);                   /* found: not eax */
+        JIT(a, 0x0f, 0xbc, 0xc0);             /* bsf eax, eax */
+        JIT(a, 0x48, 0x01, 0xc7);             /* add rdi, rax */
+        jit_patch(a, scalar, a->len, scalar + 4);
+}
+
+/* Writes state st, targets holds where each byte goes */
+static void
+jit_state(JitAsm *a, Dfa *d, int st, int *targets)
+{
+        int flags = d->states[st].flags;
+        int order[256], counts[256] = { 0 }, ntargets = 0, common = 0;
+        int nranges = 0, nself = 0, nselfranges = 0;
+        JitRange ranges[256], self[256];
+        size_t table;
+
+        a->labels[st] = a->len;
+        if (flags & DFA_MATCH) {
+                JIT(a, 0xb8, 1, 0, 0, 0, 0xc3); /* mov eax, 1; ret */
+                return;
+        }
+        if (flags & DFA_DEAD) {
+                JIT(a, 0x31, 0xc0, 0xc3); /* xor eax, eax; ret */
+                return;
+        }
+
+        for (int b = 0; b < 256; b++) {
+                int k;
+                for (k = 0; k < ntargets && order[k] != targets[b]; k++)
+                        ;
+                if (k == ntargets) order[ntargets++] = targets[b];
+                ++counts[k];
+        }
+        for (int k = 0; k < ntargets; k++)
+                if (counts[k] > counts[common]) common = k;
+        common = order[common];
+        for (int b = 0; b < 256; b++) {
+                if (targets[b] == st) {
+                        ++nself;
+                        if (b == 0 || targets[b - 1] != st) self[nselfranges++] = (JitRange) { b, b, st };
+                        self[nselfranges - 1].hi = b;
+                }
+                if (targets[b] == common) continue;
+                if (b == 0 || targets[b - 1] != targets[b]) ranges[nranges++] = (JitRange) { b, b, targets[b] };
+                ranges[nranges - 1].hi = b;
+        }
+
+        if (nself >= JIT_SKIP_MIN && nselfranges <= JIT_SKIP_MAX && !d->nfa->reverse)
+                jit_skip(a, self, nselfranges);
+        JIT(a, 0x48, 0x39, 0xf7);                /* cmp rdi, rsi */
+        JIT(a, 0x75, 0x06);                      /* jne +6 */
+        JIT(a, 0xb8);                            /* mov eax, matched */
+        jit_u32(a, flags & DFA_MATCH_AT_END ? 1 : 0);
+        JIT(a, 0xc3);                            /* ret */
+        if (d->nfa->reverse) {
+                JIT(a, 0x0f, 0xb6, 0x47, 0xff);  /* movzx eax, byte [rdi - 1] */
+                JIT(a, 0x48, 0xff, 0xcf);        /* dec rdi */
+        } else {
+                JIT(a, 0x0f, 0xb6, 0x07);        /* movzx eax, byte [rdi] */
+                JIT(a, 0x48, 0xff, 0xc7);        /* inc rdi */
+        }
+
+        if (nranges > JIT_INLINE_MAX) {
+                JIT(a, 0x48, 0x8d, 0x0d);        /* lea rcx, [table] */
+                jit_u32(a, 0);
+                JIT(a, 0x48, 0x63, 0x04, 0x81);  /* movsxd rax, [rcx + rax * 4] */
+                JIT(a, 0x48, 0x01, 0xc8);        /* add rax, rcx */
+                JIT(a, 0xff, 0xe0);              /* jmp rax */
+                table = a->len;
+                jit_patch(a, table - 13, table, table - 9);
+                for (int b = 0; b < 256; b++)
+                        jit_ref(a, targets[b], table);
+                return;
+        }
+        for (int i = 0; i < nranges; i++) {
+                if (ranges[i].lo == ranges[i].hi) {
+                        JIT(a, 0x3d);            /* cmp eax, c */
+                        jit_u32(a, ranges[i].lo);
+                        JIT(a, 0x0f, 0x84);      /* je target */
+                } else {
+                        JIT(a, 0x8d, 0x90);      /* lea edx, [rax - lo] */
+                        jit_u32(a, -ranges[i].lo);
+                        JIT(a, 0x81, 0xfa);      /* cmp edx, hi - lo */
+                        jit_u32(a, ranges[i].hi - ranges[i].lo);
+                        JIT(a, 0x0f, 0x86);      /* jbe target */
+                }
+                jit_jump(a, ranges[i].target);
+        }
+        if (common != st + 1) {
+                JIT(a, 0xe9);                    /* jmp common */
+                jit_jump(a, common);
+        }
+}
+
+static Jit *
+jit_compile(Arena *arena, Dfa *d)
+{
+        JitAsm a = { 0 };
+        Jit *jit = NULL;
+        size_t pool, size, page = 4096;
+        int *targets, start;
+        void *code;
+
+        if ((start = dfa_build(d)) < 0) return NULL;
+        memset(a.consts, 0xff, sizeof a.consts);
+        a.labels = malloc(d->nstates * sizeof *a.labels);
+        targets = malloc(256 * sizeof *targets);
+
+        if (start != 0) {
+                JIT(&a, 0xe9);                   /* jmp start */
+                jit_jump(&a, start);
+        }
+        for (int st = 0; st < d->nstates; st++) {
+                for (int b = 0; b < 256; b++)
+                        targets[b] = atomic_load(&d->states[st].next[b]);
+                jit_state(&a, d, st, targets);
+        }
+
+        /* the constants go after the code, aligned for SSE2 */
+        while (a.len % 16)
+                JIT(&a, 0xcc);
+        pool = a.len;
+        for (int i = 0; i < a.nconsts; i++)
+                for (int k = 0; k < 16; k++)
+                        JIT(&a, a.pool[i]);
+        for (int i = 0; i < a.nfixups; i++) {
+                JitFixup *f = &a.fixups[i];
+                size_t to = f->target >= 0 ? a.labels[f->target] : pool + 16 * a.consts[-1 - f->target];
+                jit_patch(&a, f->pos, to, f->base);
+        }
+
+        /* never writable and executable at once */
+        size = (a.len + page - 1) / page * page;
+        code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code == MAP_FAILED) goto done;
+        memcpy(code, a.buf, a.len);
+        if (mprotect(code, size, PROT_READ | PROT_EXEC) < 0) {
+                munmap(code, size);
+                goto done;
+        }
+        jit = arena_alloc(arena, sizeof(Jit));
+        jit->code = code;
+        jit->size = size;
+        jit->reverse = d->nfa->reverse;
+        jit->fn = (bool (*)(const unsigned char *, const unsigned char *)) code;
+done:
+        free(a.buf);
+        free(a.labels);
+        free(a.fixups);
+        free(targets);
+        return jit;
+}
+
+static bool
+jit_match(Jit *jit, const char *buf, size_t len)
+{
+        const unsigned char *c = (const unsigned char *) buf;
+        return jit->reverse ? jit->fn(c + len, c) : jit->fn(c, c + len);
+}
+
+static void
+jit_free(Jit *jit)
+{
+        munmap(jit->code, jit->size);
+}
+
+#else
+
+typedef struct Jit Jit;
+
+static Jit *
+jit_compile(Arena *arena, Dfa *d)
+{
+        (void) arena;
+        (void) d;
+        return NULL;
+}
+
+static bool
+jit_match(Jit *jit, const char *buf, size_t len)
+{
+        (void) jit;
+        (void) buf;
+        (void) len;
+        return false;
+}
+
+static void
+jit_free(Jit *jit)
+{
+        (void) jit;
+}
+
+#endif
+
+/* Glushkov automaton
+ *
+ * Patterns with up to GLUSHKOV_MAX positions, a position being a byte of a
+ * literal, a `.` or a bracket, are matched without tables: bit p of a word
+ * says whether a partial match ends at position p. Positions are numbered
+ * left to right, so most are followed by the next one and a shift steps all
+ * of those at once. The rest, the ends of loops and alternatives, look up
+ * their follow sets one at a time, only while they are live. A `^` in front
+ * and a `$` at the end are fine, anywhere else they aren't.
+ */
+#define GLUSHKOV_MAX 64
+
+typedef struct Glushkov {
+        uint64_t masks[256];           /* positions each byte can be at */
+        uint64_t follow[GLUSHKOV_MAX]; /* of each position, but the next one */
+        uint64_t next;                 /* positions followed by the next one */
+        uint64_t jumps;                /* positions with a follow */
+        uint64_t first, last;
+        bool nullable;
+        bool bol, eol;
+        int npos; /* past GLUSHKOV_MAX if the pattern doesn't fit */
+} Glushkov;
+
+/* Positions a part of the pattern starts and ends at, and whether it can
+ * match empty */
+typedef struct GlushkovFrag {
+        uint64_t first, last;
+        bool nullable;
+} GlushkovFrag;
+
+static GlushkovFrag glushkov_seq(Glushkov *g, RegexTok *toks, int t);
+
+static GlushkovFrag
+glushkov_pos(Glushkov *g, const RegexClass *class, unsigned char c)
+{
+        uint64_t bit;
+
+        if (g->npos >= GLUSHKOV_MAX) {
+                g->npos = GLUSHKOV_MAX + 1;
+                return (GlushkovFrag) { 0 };
+        }
+        bit = (uint64_t) 1 << g->npos++;
+        for (int b = 0; b < 256; b++)
+                if (class ? class_has(class, b) : b == c) g->masks[b] |= bit;
+        return (GlushkovFrag) { bit, bit, false };
+}
+
+/* Every end of a followed by every start of b */
+static void
+glushkov_link(Glushkov *g, uint64_t last, uint64_t first)
+{
+        for (; last; last &= last - 1)
+                g->follow[__builtin_ctzll(last)] |= first;
+}
+
+static GlushkovFrag
+glushkov_cat(Glushkov *g, GlushkovFrag a, GlushkovFrag b)
+{
+        glushkov_link(g, a.last, b.first);
+        return (GlushkovFrag) {
+                a.first | (a.nullable ? b.first : 0),
+                b.last | (b.nullable ? a.last : 0),
+                a.nullable && b.nullable,
+        };
+}
+
+static GlushkovFrag
+glushkov_tok(Glushkov *g, RegexTok *toks, RegexTok *t)
+{
+        static const RegexClass any = { { ~0ULL, ~0ULL, ~0ULL, ~0ULL } };
+        GlushkovFrag f = { 0, 0, true }, body;
+        int i;
+
+        switch (t->type) {
+        case ANY_CHAR:
+                return glushkov_pos(g, &any, 0);
+        case LITERAL:
+                for (int k = 0; k < t->literal.len; k++)
+                        f = glushkov_cat(g, f, glushkov_pos(g, NULL, t->lexeme[k]));
+                return f;
+        case BRACKET_EXPR:
+        case BRACKET_EXPR_EXCL:
+                return glushkov_pos(g, t->bracket_expr.class, 0);
+        case GROUP:
+                return glushkov_seq(g, toks, t->group.body);
+        case MATCH_ZERO_MORE:
+                f = glushkov_seq(g, toks, t->match_zero_more.match);
+                glushkov_link(g, f.last, f.first);
+                f.nullable = true;
+                return f;
+        case MATCH_ZERO_ONE:
+                f = glushkov_seq(g, toks, t->match_zero_one.match);
+                f.nullable = true;
+                return f;
+        case MATCH_ONE_MORE:
+                f = glushkov_seq(g, toks, t->match_one_more.match);
+                glushkov_link(g, f.last, f.first);
+                return f;
+        case MATCH_RANGE:
+                /* copies of the body, as the NFA does */
+                for (i = 0; i < t->match_range.min; i++)
+                        f = glushkov_cat(g, f, glushkov_seq(g, toks, t->match_range.match));
+                if (t->match_range.max == RANGE_INF) {
+                        body = glushkov_seq(g, toks, t->match_range.match);
+                        glushkov_link(g, body.last, body.first);
+                        body.nullable = true;
+                        f = glushkov_cat(g, f, body);
+                }
+                for (; i < t->match_range.max; i++) {
+                        body = glushkov_seq(g, toks, t->match_range.match);
+                        body.nullable = true;
+                        f = glushkov_cat(g, f, body);
+                }
+                return f;
+        case MATCH_OR:
+                f = glushkov_seq(g, toks, t->match_or.left);
+                body = glushkov_seq(g, toks, t->match_or.right);
+                return (GlushkovFrag) { f.first | body.first, f.last | body.last, f.nullable || body.nullable };
+        default:
+                /* anchors in the middle and backreferences */
+                g->npos = GLUSHKOV_MAX + 1;
+                return f;
+        }
+}
+
+static GlushkovFrag
+glushkov_seq(Glushkov *g, RegexTok *toks, int t)
+{
+        GlushkovFrag f = { 0, 0, true };
+
+        for (; t != NONE && g->npos <= GLUSHKOV_MAX; t = toks[t].next)
+                f = glushkov_cat(g, f, glushkov_tok(g, toks, &toks[t]));
+        return f;
+}
+
+/* NULL if toks doesn't fit */
+static Glushkov *
+glushkov_compile(Arena *a, RegexTok *toks)
+{
+        Glushkov tmp = { 0 }, *g = &tmp;
+        GlushkovFrag f = { 0, 0, true };
+        int t = 0;
+
+        if (toks == NULL) return NULL;
+        if (toks[0].type == START_OF_LINE) {
+                g->bol = true;
+                t = toks[0].next;
+        }
+        for (; t != NONE && g->npos <= GLUSHKOV_MAX; t = toks[t].next) {
+                if (toks[t].type == END_OF_LINE && toks[t].next == NONE) {
+                        g->eol = true;
+                        break;
+                }
+                f = glushkov_cat(g, f, glushkov_tok(g, toks, &toks[t]));
+        }
+        if (g->npos > GLUSHKOV_MAX) return NULL;
+
+        g->first = f.first;
+        g->last = f.last;
+        g->nullable = f.nullable;
+        for (int p = 0; p < g->npos; p++) {
+                uint64_t next = p + 1 < GLUSHKOV_MAX ? (uint64_t) 1 << (p + 1) : 0;
+                if (g->follow[p] & next) {
+                        g->next |= (uint64_t) 1 << p;
+                        g->follow[p] &= ~next;
+                }
+                if (g->follow[p]) g->jumps |= (uint64_t) 1 << p;
+        }
+        return memcpy(arena_alloc(a, sizeof(Glushkov)), g, sizeof(Glushkov));
+}
+
+/* A step per byte */
+static bool
+glushkov_match(Glushkov *g, const char *buf, size_t len, Budget *b)
+{
+        const unsigned char *c = (const unsigned char *) buf;
+        uint64_t d = 0, start = g->first;
+        size_t end = len;
+
+        /* an empty match, unless it has to be the whole input */
+        if (g->nullable && !(g->bol && g->eol && len > 0)) return true;
+        if (b->max - b->steps < len) end = b->max - b->steps;
+
+        for (size_t i = 0; i < end; i++) {
+                uint64_t next = (d & g->next) << 1 | start;
+                for (uint64_t j = d & g->jumps; j; j &= j - 1)
+                        next |= g->follow[__builtin_ctzll(j)];
+                d = next & g->masks[c[i]];
+                if (g->bol) {
+                        start = 0;
+                        if (d == 0) {
+                                b->steps += i + 1;
+                                return false;
+                        }
+                }
+                if (d & g->last && !g->eol) {
+                        b->steps += i + 1;
+                        return true;
+                }
+        }
+        b->steps += end;
+        if (end != len) {
+                b->exceeded = true;
+                return false;
+        }
+        return d & g->last;
+}
+
+/* RegexSet
+ *
+ * Patterns that are plain strings go to an Aho-Corasick automaton, the rest
+ * are merged into one NFA with a MATCH per pattern and run on a lazy DFA
+ * whose states know which patterns they match. Each of them is a single
+ * pass over the input whatever the number of patterns.
+ */
+static void
+nfa_set_collect(Nfa *n, NfaList *l, uint64_t *matched)
+{
+        for (int i = 0; i < l->n; i++)
+                if (n->states[l->pcs[i]].op == NFA_MATCH)
+                        set_bit(matched, n->states[l->pcs[i]].x);
+}
+
+/* nfa_match() that doesn't stop at the first MATCH */
+static void
+nfa_set_match(Nfa *n, const char *buf, size_t len, uint64_t *matched)
+{
+        NfaScratch s;
+        NfaList tmp;
+        void *mem = calloc(1, nfa_scratch_size(n));
+
+        nfa_scratch_init(&s, n, mem);
+        s.clist.n = 0;
+        ++s.gen;
+        nfa_add(n, &s, &s.clist, 0, true, len == 0);
+        nfa_set_collect(n, &s.clist, matched);
+
+        for (size_t pos = 0; pos < len; pos++) {
+                s.nlist.n = 0;
+                ++s.gen;
+                for (int i = 0; i < s.clist.n; i++) {
+                        int pc = s.clist.pcs[i];
+                        if (nfa_step_accepts(&n->states[pc], buf[pos]))
+                                nfa_add(n, &s, &s.nlist, pc + 1, false, pos + 1 == len);
+                }
+                if (!n->anchored)
+                        nfa_add(n, &s, &s.nlist, 0, false, pos + 1 == len);
+                nfa_set_collect(n, &s.nlist, matched);
+                tmp = s.clist;
+                s.clist = s.nlist;
+                s.nlist = tmp;
+                if (s.clist.n == 0 && n->anchored) break;
+        }
+        free(mem);
+}
+
+/* dfa_match() that doesn't stop at the first match */
+static void
+dfa_set_match(Dfa *d, const char *buf, size_t len, uint64_t *matched)
+{
+        const unsigned char *c = (const unsigned char *) buf;
+        const unsigned char *end = c + len;
+        int s, last = DFA_UNKNOWN;
+
+        if (atomic_load_explicit(&d->full, memory_order_relaxed))
+                dfa_flush(d);
+
+        pthread_rwlock_rdlock(&d->flush);
+        s = dfa_start(d);
+        for (;;) {
+                if (s == DFA_FULL) {
+                        pthread_rwlock_unlock(&d->flush);
+                        nfa_set_match(d->nfa, buf, len, matched);
+                        return;
+                }
+                DfaState *st = &d->states[s];
+                if (st->flags & DFA_DEAD) break;
+                if (c == end) {
+                        for (int k = 0; k < d->nwords; k++)
+                                matched[k] |= st->match_at_end[k];
+                        break;
+                }
+                /* a state that loops on itself only has to be added once */
+                if (s != last && st->flags & DFA_MATCH) {
+                        for (int k = 0; k < d->nwords; k++)
+                                matched[k] |= st->match[k];
+                        last = s;
+                }
+                int next = atomic_load_explicit(&st->next[*c], memory_order_acquire);
+                if (next == DFA_UNKNOWN)
+                        next = dfa_next(d, s, *c);
+                s = next;
+                ++c;
+        }
+        pthread_rwlock_unlock(&d->flush);
+}
+
+/* Bytes that appear in no pattern share class 0, so the transition table
+ * has one column per distinct byte of the patterns */
+typedef struct AhoCorasick {
+        unsigned char class[256];
+        int nclasses;
+        int *delta; /* nclasses per node, failures already folded in */
+        int *out;   /* first pattern that ends at the node, -1 if none */
+        int *dict;  /* closest node on the failure chain with an out */
+        int *same;  /* per pattern, next one with the same string */
+} AhoCorasick;
+
+static AhoCorasick *
+ac_compile(Arena *a, RegexTok **lits, int *ids, int count, int npatterns)
+{
+        AhoCorasick *ac = arena_alloc(a, sizeof(AhoCorasick));
+        int nodes = 1, maxnodes = 1, nc;
+        int *fail, *queue, head = 0, tail = 0;
+
+        ac->nclasses = 1;
+        for (int i = 0; i < count; i++) {
+                maxnodes += lits[i]->literal.len;
+                for (int k = 0; k < lits[i]->literal.len; k++) {
+                        unsigned char c = lits[i]->lexeme[k];
+                        if (ac->class[c] == 0) ac->class[c] = ac->nclasses++;
+                }
+        }
+        nc = ac->nclasses;
+        ac->delta = arena_alloc(a, (size_t) maxnodes * nc * sizeof(int));
+        ac->out = arena_alloc(a, maxnodes * sizeof(int));
+        ac->dict = arena_alloc(a, maxnodes * sizeof(int));
+        ac->same = arena_alloc(a, npatterns * sizeof(int));
+        memset(ac->delta, 0xff, (size_t) maxnodes * nc * sizeof(int));
+        memset(ac->out, 0xff, maxnodes * sizeof(int));
+
+        /* the trie */
+        for (int i = 0; i < count; i++) {
+                int u = 0;
+                for (int k = 0; k < lits[i]->literal.len; k++) {
+                        int *v = &ac->delta[u * nc + ac->class[(unsigned char) lits[i]->lexeme[k]]];
+                        if (*v == -1) *v = nodes++;
+                        u = *v;
+                }
+                ac->same[ids[i]] = ac->out[u];
+                ac->out[u] = ids[i];
+        }
+
+        /* failure links, breadth first so the row of fail[u] is complete
+         * before u's is */
+        fail = malloc(nodes * sizeof(int));
+        queue = malloc(nodes * sizeof(int));
+        fail[0] = 0;
+        ac->dict[0] = -1;
+        queue[tail++] = 0;
+        while (head < tail) {
+                int u = queue[head++];
+                for (int c = 0; c < nc; c++) {
+                        int *v = &ac->delta[u * nc + c];
+                        int f = u ? ac->delta[fail[u] * nc + c] : 0;
+                        if (*v == -1) {
+                                *v = f;
+                                continue;
+                        }
+                        fail[*v] = f;
+                        ac->dict[*v] = ac->out[f] != -1 ? f : ac->dict[f];
+                        queue[tail++] = *v;
+                }
+        }
+        free(fail);
+        free(queue);
+        return ac;
+}
+
+static void
+ac_match(AhoCorasick *ac, const char *buf, size_t len, uint64_t *matched)
+{
+        const unsigned char *c = (const unsigned char *) buf;
+        int u = 0;
+
+        for (size_t i = 0; i < len; i++) {
+                u = ac->delta[u * ac->nclasses + ac->class[c[i]]];
+                for (int v = ac->out[u] != -1 ? u : ac->dict[u]; v != -1; v = ac->dict[v])
+                        for (int id = ac->out[v]; id != -1; id = ac->same[id])
+                                set_bit(matched, id);
+        }
+}
+
+/* Streaming
+ *
+ * The NFA simulation again, fed a chunk at a time. Every thread remembers
+ * where its match started and when two get to the same state the oldest
+ * one wins, so a match is reported as soon as it ends, starting as far left
+ * as possible. Everything in flight is dropped then, matches don't overlap.
+ * The state is a couple of lists as long as the program, whatever the input.
+ */
+struct RegexStream {
+        Nfa *nfa;
+        Prefilter *prefilter;
+        NfaScratch s;
+        size_t *start;  /* per pc, where the thread of clist at pc started */
+        size_t *nstart; /* same for nlist */
+        size_t pos;     /* offset of the next byte */
+        size_t last_end;
+        void (*on_match)(RegexMatch match, void *data);
+        void *data;
+};
+
+/* nfa_add() for a thread that started at start */
+static bool
+stream_add(RegexStream *st, NfaList *l, size_t *starts, int pc, size_t start, bool bol)
+{
+        int first = l->n;
+        bool matched = nfa_add(st->nfa, &st->s, l, pc, bol, false);
+        for (int i = first; i < l->n; i++)
+                starts[l->pcs[i]] = start;
+        return matched;
+}
+
+/* An empty match where the last one ended isn't reported */
+static bool
+stream_report(RegexStream *st, size_t start, size_t end)
+{
+        if (start == end && end == st->last_end) return false;
+        st->last_end = end;
+        st->on_match((RegexMatch) { start, end }, st->data);
+        return true;
+}
+
+static void
+stream_reset(RegexStream *st)
+{
+        st->s.clist.n = 0;
+        ++st->s.gen;
+}
+
+RegexStream *
+regex_stream_begin(Regex expr, void (*on_match)(RegexMatch match, void *data), void *data)
+{
+        RegexStream *st;
+        Nfa *n = expr.nfa;
+        char *mem;
+
+        if (expr.tokens == NULL) n = NULL;
+        else if (n == NULL) todo("streaming with backreferences");
+        mem = calloc(1, sizeof(RegexStream) +
+                                (n ? nfa_scratch_size(n) + 2 * n->len * sizeof(size_t) : 0));
+        st = (RegexStream *) mem;
+        st->nfa = n;
+        st->prefilter = expr.prefilter;
+        st->last_end = REGEX_UNSET;
+        st->on_match = on_match;
+        st->data = data;
+        if (n) {
+                st->start = (size_t *) (st + 1);
+                st->nstart = st->start + n->len;
+                nfa_scratch_init(&st->s, n, st->nstart + n->len);
+                ++st->s.gen;
+        }
+        return st;
+}
+
+void
+regex_stream_feed(RegexStream *st, const char *buf, size_t len)
+{
+        Nfa *n = st->nfa;
+        Prefilter *p = st->prefilter;
+        NfaList tmp;
+        size_t *stmp;
+        size_t from;
+
+        for (size_t i = 0; i < len; i++, st->pos++) {
+                if (n == NULL || (n->anchored && st->pos > 0 && st->s.clist.n == 0)) {
+                        /* nothing can match anymore */
+                        st->pos += len - i;
+                        return;
+                }
+                /* with nothing in flight a match can only start at its prefix */
+                if (st->s.clist.n == 0 && p && p->prefix) {
+                        const char *hit = memchr(buf + i, p->lit[0], len - i);
+                        size_t skip = (hit ? (size_t) (hit - buf) : len) - i;
+                        i += skip;
+                        st->pos += skip;
+                        if (i == len) return;
+                }
+
+                if ((!n->anchored || st->pos == 0) &&
+                    stream_add(st, &st->s.clist, st->start, 0, st->pos, st->pos == 0) &&
+                    stream_report(st, st->pos, st->pos))
+                        stream_reset(st);
+
+                st->s.nlist.n = 0;
+                ++st->s.gen;
+                for (int k = 0; k < st->s.clist.n; k++) {
+                        int pc = st->s.clist.pcs[k];
+                        if (nfa_step_accepts(&n->states[pc], buf[i]))
+                                stream_add(st, &st->s.nlist, st->nstart, pc + 1, st->start[pc], false);
+                }
+                tmp = st->s.clist;
+                st->s.clist = st->s.nlist;
+                st->s.nlist = tmp;
+                stmp = st->start;
+                st->start = st->nstart;
+                st->nstart = stmp;
+
+                from = REGEX_UNSET;
+                for (int k = 0; k < st->s.clist.n; k++) {
+                        int pc = st->s.clist.pcs[k];
+                        if (n->states[pc].op == NFA_MATCH && st->start[pc] < from)
+                                from = st->start[pc];
+                }
+                if (from != REGEX_UNSET && stream_report(st, from, st->pos + 1))
+                        stream_reset(st);
+        }
+}
+
+void
+regex_stream_end(RegexStream *st)
+{
+        Nfa *n = st->nfa;
+        NfaList *l = &st->s.clist;
+        NfaList end = { .pcs = st->s.nlist.pcs, .n = 0 };
+        size_t from = REGEX_UNSET;
+
+        /* the $ that were waiting for the end of the input */
+        for (int k = 0; n && k < l->n; k++) {
+                int pc = l->pcs[k];
+                if (n->states[pc].op != NFA_EOL || st->start[pc] >= from) continue;
+                ++st->s.gen;
+                end.n = 0;
+                if (nfa_add(n, &st->s, &end, pc + 1, false, true))
+                        from = st->start[pc];
+        }
+        /* and a match that starts right at the end */
+        if (n && from == REGEX_UNSET && (!n->anchored || st->pos == 0)) {
+                ++st->s.gen;
+                end.n = 0;
+                if (nfa_add(n, &st->s, &end, 0, st->pos == 0, true))
+                        from = st->pos;
+        }
+        if (from != REGEX_UNSET)
+                stream_report(st, from, st->pos);
+        free(st);
+}
+
+/* First offset from o on that a match can start at, len if none */
+static size_t
+skip_to_first(Regex expr, const char *buf, size_t len, size_t o)
+{
+        while (o < len && !class_has(expr.first, buf[o]))
+                ++o;
+        return o;
+}
+
+static bool image_match(struct Image *im, const char *buf, size_t len, Budget *b);
+
+/* The DFA of expr a search runs on, backwards if there is one that way.
+ * The JIT doesn't count steps, so it only runs without a budget. */
+static bool
+dfa_run(Regex expr, const char *buf, size_t len, Budget *b)
+{
+        if (expr.jit && b->max == UINT64_MAX) return jit_match(expr.jit, buf, len);
+        if (expr.image) return image_match(expr.image, buf, len, b);
+        return dfa_match(expr.rdfa ? expr.rdfa : expr.dfa, buf, len, b);
+}
+
+/* Offset of buf a match of expr can start at, REGEX_UNSET if none can */
+static size_t
+match_start(Regex expr, const char *buf, size_t len)
+{
+        Prefilter *p = expr.prefilter;
+        const char *hit;
+        size_t o = 0;
+
+        if (len < expr.minlen) return REGEX_UNSET;
+        /* one pass from the end, no need to look for the literal first */
+        if (expr.rnfa) return 0;
+        if (p) {
+                if ((hit = prefilter_find(p, buf, len)) == NULL) {
+                        COUNT(expr.counters, prefilter_misses);
+                        return REGEX_UNSET;
+                }
+                COUNT(expr.counters, prefilter_hits);
+                /* a match can't start before the first copy of its prefix */
+                if (p->prefix) o = hit - buf;
+        }
+        if (expr.first && !(p && p->prefix)) o = skip_to_first(expr, buf, len, o);
+        return len - o < expr.minlen ? REGEX_UNSET : o;
+}
+
+/* What match_n() keeps from one input to the next of a batch */
+typedef struct Matcher {
+        Eval e;       /* the backtracker's stacks */
+        NfaScratch s; /* for the NFA engine, once mem is set */
+        void *mem;
+} Matcher;
+
+static void
+matcher_free(Matcher *m)
+{
+        free(m->e.frames);
+        free(m->e.runs);
+        free(m->mem);
+}
+
+/* The backtracker from o on */
+static bool
+bt_match(Regex expr, Eval *e, const char *buf, size_t len, size_t o, Budget *b)
+{
+        Prefilter *p = expr.prefilter;
+        uint64_t local[64];
+        const char *hit;
+        size_t words;
+        bool matched = false;
+
+        e->toks = expr.tokens;
+        e->str = buf;
+        e->len = len;
+        e->budget = b;
+        e->memo = NULL;
+        e->counters = expr.counters;
+        /* one memo for every start, a pair that fails fails from any */
+        if ((words = memo_words(expr, len)) > 0)
+                e->memo = words <= 64 ? memset(local, 0, words * sizeof *local) : calloc(words, sizeof *local);
+        if (expr.tokens->type == START_OF_LINE) {
+                COUNT(expr.counters, starts);
+                matched = eval(e, 0, 0);
+                goto done;
+        }
+        while (o <= len && len - o >= expr.minlen && !b->exceeded) {
+                COUNT(expr.counters, starts);
+                if ((matched = eval(e, 0, o))) break;
+                if (p == NULL || !p->prefix) {
+                        o = expr.first ? skip_to_first(expr, buf, len, o + 1) : o + 1;
+                } else if ((hit = prefilter_find(p, buf + o + 1, len - o - 1))) {
+                        COUNT(expr.counters, prefilter_hits);
+                        o = hit - buf;
+                } else {
+                        COUNT(expr.counters, prefilter_misses);
+                        break;
+                }
+        }
+done:
+        if (e->memo != local) free(e->memo);
+        return matched;
+}
+
+static bool
+matcher_run(Matcher *m, Regex expr, const char *buf, size_t len, Budget *b)
+{
+        Nfa *n = expr.rnfa ? expr.rnfa : expr.nfa;
+        size_t o;
+
+        if (expr.tokens == NULL || (o = match_start(expr, buf, len)) == REGEX_UNSET) return false;
+        if (expr.engine == REGEX_DFA) return dfa_run(expr, buf + o, len - o, b);
+        if (expr.engine == REGEX_GLUSHKOV) return glushkov_match(expr.glushkov, buf + o, len - o, b);
+        if (expr.engine == REGEX_NFA) {
+                if (m->mem == NULL) {
+                        m->mem = calloc(1, nfa_scratch_size(n));
+                        nfa_scratch_init(&m->s, n, m->mem);
+                }
+                return nfa_run(n, &m->s, buf + o, len - o, b);
+        }
+        return bt_match(expr, &m->e, buf, len, o, b);
+}
+
+static bool
+match_n(Regex expr, const char *buf, size_t len, Budget *b)
+{
+        Matcher m = { 0 };
+        bool matched = matcher_run(&m, expr, buf, len, b);
+
+        matcher_free(&m);
+        return matched;
+}
+
+bool
+regex_match_n(Regex expr, const char *buf, size_t len)
+{
+        Budget b = UNLIMITED;
+        return match_n(expr, buf, len, &b);
+}
+
+bool
+regex_match_limited(Regex expr, const char *buf, size_t len, uint64_t max_steps, RegexStatus *status)
+{
+        Budget b = { .max = max_steps };
+        bool matched = match_n(expr, buf, len, &b);
+
+        if (status) {
+                status->code = b.exceeded ? REGEX_BUDGET_EXCEEDED : REGEX_OK;
+                status->steps = b.steps;
+        }
+        return matched;
+}
+
+size_t
+regex_match_batch(Regex expr, const char **strs, const size_t *lens, size_t n, uint8_t *results)
+{
+        Matcher m = { 0 };
+        size_t matches = 0, *starts = NULL;
+
+        /* the DFA interleaves inputs, the rest go one at a time */
+        if (expr.tokens && expr.engine == REGEX_DFA && !expr.jit && !expr.image) {
+                starts = malloc(n * sizeof *starts);
+                for (size_t i = 0; i < n; i++)
+                        starts[i] = match_start(expr, strs[i], lens[i]);
+                dfa_match_batch(expr.rdfa ? expr.rdfa : expr.dfa, strs, lens, starts, n, results);
+        }
+        for (size_t i = 0; i < n; i++) {
+                Budget b = UNLIMITED;
+                if (starts == NULL || results[i] == DFA_RETRY)
+                        results[i] = matcher_run(&m, expr, strs[i], lens[i], &b);
+                matches += results[i];
+        }
+        matcher_free(&m);
+        free(starts);
+        return matches;
+}
+
+/* regex_exec() from start on. hint caches where the prefilter literal was
+ * last found, REGEX_UNSET if it wasn't looked for yet and past len if it
+ * isn't in buf, so scanning a buffer match by match only looks once. */
+static bool
+exec_from(Regex expr, const char *buf, size_t len, size_t start, size_t *hint,
+          RegexMatch *groups, int ngroups)
+{
+        Prefilter *p = expr.prefilter;
+        Budget unlimited = UNLIMITED;
+        const char *hit;
+        size_t *caps;
+        bool matched;
+
+        if (expr.tokens == NULL || start > len || len - start < expr.minlen) return false;
+        if (expr.nfa == NULL) todo("submatches with backreferences");
+        if (expr.nfa->anchored && start > 0) return false;
+        if (p) {
+                if (*hint == REGEX_UNSET || *hint < start) {
+                        hit = prefilter_find(p, buf + start, len - start);
+                        *hint = hit ? (size_t) (hit - buf) : len + 1;
+                }
+                if (*hint > len) return false;
+                if (p->prefix) start = *hint;
+        }
+        /* the DFA says no much faster than the VM */
+        if ((expr.dfa || expr.image) && !dfa_run(expr, buf + start, len - start, &unlimited))
+                return false;
+        if (expr.glushkov && !glushkov_match(expr.glushkov, buf + start, len - start, &unlimited))
+                return false;
+
+        caps = malloc(2 * ngroups * sizeof(size_t));
+        matched = pike_exec(expr.nfa, buf, len, start, caps, 2 * ngroups);
+        for (int i = 0; i < ngroups; i++) {
+                groups[i].start = groups[i].end = REGEX_UNSET;
+                if (!matched) continue;
+                if (caps[2 * i] == REGEX_UNSET || caps[2 * i + 1] == REGEX_UNSET) continue;
+                groups[i].start = caps[2 * i];
+                groups[i].end = caps[2 * i + 1];
+        }
+        free(caps);
+        return matched;
+}
+
+bool
+regex_exec(Regex expr, const char *buf, size_t len, RegexMatch *groups, int ngroups)
+{
+        size_t hint = REGEX_UNSET;
+        return exec_from(expr, buf, len, 0, &hint, groups, ngroups);
+}
+
+bool
+regex_find_next(Regex expr, const char *buf, size_t len, size_t start, RegexMatch *out)
+{
+        size_t hint = REGEX_UNSET;
+        return exec_from(expr, buf, len, start, &hint, out, 1);
+}
+
+RegexIter
+regex_iter(Regex expr, const char *buf, size_t len)
+{
+        return (RegexIter) {
+                .expr = expr,
+                .buf = buf,
+                .len = len,
+                .pos = 0,
+                .last_end = REGEX_UNSET,
+                .hint = REGEX_UNSET,
+        };
+}
+
+bool
+regex_iter_next(RegexIter *it, RegexMatch *out)
+{
+        while (it->pos <= it->len) {
+                if (!exec_from(it->expr, it->buf, it->len, it->pos, &it->hint, out, 1)) {
+                        it->pos = it->len + 1;
+                        return false;
+                }
+                /* an empty match right where the last one ended isn't a new one */
+                if (out->start == out->end && out->start == it->last_end) {
+                        it->pos = out->start + 1;
+                        continue;
+                }
+                it->pos = out->end > out->start ? out->end : out->end + 1;
+                it->last_end = out->end;
+                return true;
+        }
+        return false;
+}
+
+bool
+regex_match(Regex expr, char *str)
+{
+        return regex_match_n(expr, str, strlen(str));
+}
+
+char *
+regex_repr(Regex expr)
+{
+        return expr.repr;
+}
+
+bool
+regex_stats(Regex expr, RegexStats *stats)
+{
+        Counters *c = expr.counters;
+
+        memset(stats, 0, sizeof *stats);
+        if (expr.dfa) stats->dfa_flushes += atomic_load_explicit(&expr.dfa->flushes, memory_order_relaxed);
+        if (expr.rdfa) stats->dfa_flushes += atomic_load_explicit(&expr.rdfa->flushes, memory_order_relaxed);
+        if (c == NULL) return false;
+        for (int i = 0; i < expr.ntokens; i++)
+                stats->evals[expr.tokens[i].type] += atomic_load_explicit(&c->evals[i], memory_order_relaxed);
+        stats->backtracks = atomic_load_explicit(&c->backtracks, memory_order_relaxed);
+        stats->starts = atomic_load_explicit(&c->starts, memory_order_relaxed);
+        stats->prefilter_hits = atomic_load_explicit(&c->prefilter_hits, memory_order_relaxed);
+        stats->prefilter_misses = atomic_load_explicit(&c->prefilter_misses, memory_order_relaxed);
+        return true;
+}
+
+void
+print_token_stats(Regex r)
+{
+        RegexStats s;
+
+        if (!regex_stats(r, &s)) {
+                printf("Expr: `%s`, built without REGEX_STATS\n", regex_repr(r));
+                return;
+        }
+        printf("Expr: `%s`\n", regex_repr(r));
+        printf("%12s  Token\n", "Evals");
+        for (int t = r.tokens ? 0 : NONE; t != NONE; t = r.tokens[t].next)
+                print_token_ast_branch(r.tokens, t, 0, r.counters->evals);
+        printf("Starts: %llu, backtracks: %llu, prefilter hits: %llu, misses: %llu, DFA flushes: %llu\n",
+               (unsigned long long) s.starts, (unsigned long long) s.backtracks,
+               (unsigned long long) s.prefilter_hits, (unsigned long long) s.prefilter_misses,
+               (unsigned long long) s.dfa_flushes);
+}
+
+static void
+dfa_destroy(Dfa *d)
+{
+        pthread_mutex_destroy(&d->lock);
+        pthread_rwlock_destroy(&d->flush);
+}
+
+void
+regex_free(Regex expr)
+{
+        if (expr.dfa) dfa_destroy(expr.dfa);
+        if (expr.rdfa) dfa_destroy(expr.rdfa);
+        if (expr.jit) jit_free(expr.jit);
+        arena_free(expr.arena);
+}
+
+RegexSet
+regex_set_compile(char **exprs, int count)
+{
+        RegexSet set = { .len = count };
+        RegexTok **lits = malloc(count * sizeof(RegexTok *));
+        RegexTok **toks = malloc(count * sizeof(RegexTok *));
+        int *litids = malloc(count * sizeof(int));
+        int *ids = malloc(count * sizeof(int));
+        int nlits = 0, ntoks = 0;
+
+        set.arena = arena_new();
+        for (int i = 0; i < count; i++) {
+                Regex r = { .arena = set.arena };
+                get_tokens(&r, exprs[i]);
+                /* never matches, as for regex_match() */
+                if (r.tokens == NULL) continue;
+                if (has_backrefs(r.tokens, 0)) todo("backreferences in a RegexSet");
+                if (r.ntokens == 1 && r.tokens[0].type == LITERAL) {
+                        litids[nlits] = i;
+                        lits[nlits++] = &r.tokens[0];
+                } else {
+                        ids[ntoks] = i;
+                        toks[ntoks++] = r.tokens;
+                }
+        }
+        if (nlits)
+                set.ac = ac_compile(set.arena, lits, litids, nlits, count);
+        if (ntoks) {
+                set.nfa = nfa_compile_set(set.arena, toks, ids, ntoks);
+                set.dfa = dfa_new(set.arena, set.nfa, count);
+        }
+        free(lits);
+        free(toks);
+        free(litids);
+        free(ids);
+        return set;
+}
+
+bool
+regex_set_match(RegexSet set, const char *buf, size_t len, uint64_t *matched)
+{
+        int nwords = (set.len + 63) / 64;
+        bool any = false;
+
+        memset(matched, 0, nwords * sizeof(uint64_t));
+        if (set.ac) ac_match(set.ac, buf, len, matched);
+        if (set.dfa) dfa_set_match(set.dfa, buf, len, matched);
+        for (int k = 0; k < nwords; k++)
+                any = any || matched[k];
+        return any;
+}
+
+void
+regex_set_free(RegexSet set)
+{
+        if (set.dfa) dfa_destroy(set.dfa);
+        arena_free(set.arena);
+}
+
+/* Code generation
+ *
+ * The whole DFA of a pattern is built up front and written out as a C
+ * function with a label per state and gotos for the transitions. Bytes that
+ * go to the same state are tested with a switch, or a bitmap when there are
+ * many of them, and the commonest target of a state is its fallthrough.
+ */
+static void
+codegen_byte(FILE *out, int b)
+{
+        if (b >= ' ' && b <= '~' && b != '\'' && b != '\\')
+                fprintf(out, "'%c'", b);
+        else
+                fprintf(out, "%d", b);
+}
+
+/* Index of bitmap in maps, adding it if it's new */
+static int
+codegen_map(RegexClass **maps, int *nmaps, RegexClass *bitmap)
+{
+        for (int i = 0; i < *nmaps; i++)
+                if (memcmp(&(*maps)[i], bitmap, sizeof *bitmap) == 0) return i;
+        *maps = realloc(*maps, (*nmaps + 1) * sizeof **maps);
+        (*maps)[*nmaps] = *bitmap;
+        return (*nmaps)++;
+}
+
+/* Writes state st, targets holds where each byte goes */
+static void
+codegen_state(FILE *out, Dfa *d, int st, int *targets, RegexClass **maps, int *nmaps)
+{
+        int flags = d->states[st].flags;
+        int order[256], index[256], counts[256] = { 0 };
+        int ntargets = 0, common = 0, small = 0;
+
+        fprintf(out, "s%d:\n", st);
+        if (flags & DFA_MATCH) {
+                fprintf(out, "        return true;\n");
+                return;
+        }
+        if (flags & DFA_DEAD) {
+                fprintf(out, "        return false;\n");
+                return;
+        }
+        fprintf(out, "        if (c == end) return %s;\n", flags & DFA_MATCH_AT_END ? "true" : "false");
+        fprintf(out, "        b = *c++;\n");
+
+        for (int b = 0; b < 256; b++) {
+                int k;
+                for (k = 0; k < ntargets && order[k] != targets[b]; k++)
+                        ;
+                if (k == ntargets) order[ntargets++] = targets[b];
+                index[b] = k;
+                ++counts[k];
+        }
+        for (int k = 0; k < ntargets; k++)
+                if (counts[k] > counts[common]) common = k;
+
+        for (int k = 0; k < ntargets; k++) {
+                RegexClass bitmap = { 0 };
+                if (k == common) continue;
+                if (counts[k] <= 4) {
+                        ++small;
+                        continue;
+                }
+                for (int b = 0; b < 256; b++)
+                        if (index[b] == k) class_add(&bitmap, b);
+                fprintf(out, "        if (c%d[b >> 6] >> (b & 63) & 1) goto s%d;\n",
+                        codegen_map(maps, nmaps, &bitmap), order[k]);
+        }
+        if (small) {
+                fprintf(out, "        switch (b) {\n");
+                for (int k = 0; k < ntargets; k++) {
+                        if (k == common || counts[k] > 4) continue;
+                        for (int b = 0; b < 256; b++) {
+                                if (index[b] != k) continue;
+                                fprintf(out, "        case ");
+                                codegen_byte(out, b);
+                                fprintf(out, ":\n");
+                        }
+                        fprintf(out, "                goto s%d;\n", order[k]);
+                }
+                fprintf(out, "        }\n");
+        }
+        fprintf(out, "        goto s%d;\n", order[common]);
+}
+
+/* s inside a comment, with a backslash between the * and / of every
+ * comment delimiter in it, so patterns like a*\/b can't end it. Newlines
+ * are written as \n, a backslash before one would splice the lines */
+static void
+codegen_comment(FILE *out, const char *s)
+{
+        for (; *s; s++) {
+                if (*s == '\n') fputs("\\n", out);
+                else fputc(*s, out);
+                if ((s[0] == '*' && s[1] == '/') || (s[0] == '/' && s[1] == '*')) fputc('\\', out);
+        }
+}
+
+bool
+regex_codegen(char *expr, const char *name, FILE *out)
+{
+        Regex r = regex_compile_flags(expr, REGEX_DFA);
+        Dfa *d = r.dfa;
+        RegexClass *maps = NULL;
+        int *targets = NULL, nmaps = 0, start;
+        bool scans = false, ok = false;
+        char *body = NULL;
+        size_t bodylen = 0;
+        FILE *f;
+
+        if (r.tokens == NULL) goto done;
+
+        if ((start = dfa_build(d)) < 0) goto done;
+        for (int st = 0; st < d->nstates; st++)
+                scans = scans || !(d->states[st].flags & (DFA_MATCH | DFA_DEAD));
+
+        /* the states first, they tell which bitmaps go on top */
+        targets = malloc((size_t) d->nstates * 256 * sizeof(int));
+        f = open_memstream(&body, &bodylen);
+        fprintf(f, "        goto s%d;\n", start);
+        for (int st = 0; st < d->nstates; st++) {
+                int *t = targets + (size_t) st * 256;
+                for (int b = 0; b < 256; b++)
+                        t[b] = atomic_load(&d->states[st].next[b]);
+                codegen_state(f, d, st, t, &maps, &nmaps);
+        }
+        fclose(f);
+
+        fprintf(out, "/* `");
+        codegen_comment(out, expr);
+        fprintf(out, "` anywhere in buf, %d states */\n", d->nstates);
+        fprintf(out, "bool\n%s(const char *buf, size_t len)\n{\n", name);
+        for (int i = 0; i < nmaps; i++)
+                fprintf(out, "        static const uint64_t c%d[4] = { 0x%016llx, 0x%016llx, 0x%016llx, 0x%016llx };\n",
+                        i, (unsigned long long) maps[i].bits[0], (unsigned long long) maps[i].bits[1],
+                        (unsigned long long) maps[i].bits[2], (unsigned long long) maps[i].bits[3]);
+        if (scans) {
+                fprintf(out, "        const unsigned char *c = (const unsigned char *) buf, *end = c + len;\n");
+                fprintf(out, "        unsigned char b;\n\n");
+        } else {
+                fprintf(out, "        (void) buf;\n        (void) len;\n\n");
+        }
+        fwrite(body, 1, bodylen, out);
+        fprintf(out, "}\n");
+        ok = true;
+done:
+        free(body);
+        free(maps);
+        free(targets);
+        regex_free(r);
+        return ok;
+}
+
+/* Serialization
+ *
+ * An image is the pattern and, if it has one that fits, its whole DFA as
+ * a table of state indices, the same way regex_codegen() builds it. Every
+ * reference in it is an offset or an index, so it can be mapped anywhere,
+ * read-only, and shared by processes: regex_load() parses the pattern again,
+ * which is cheap, and matches on the table in place instead of building the
+ * DFA state by state.
+ *
+ * header | pattern, NUL | DFA header | next, 256 per state | flags per state
+ *
+ * Each part starts at a multiple of 8 bytes.
+ */
+#define IMAGE_MAGIC "rgximage"
+#define IMAGE_VERSION 1
+#define IMAGE_ENDIAN 0x01020304
+
+typedef struct ImageHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t endian; /* IMAGE_ENDIAN in the byte order it was written in */
+        uint32_t engine;
+        uint32_t patlen;
+        uint64_t size; /* of the whole image */
+        uint64_t dfa;  /* offset of the ImageDfa, 0 if there's none */
+} ImageHeader;
+
+typedef struct ImageDfa {
+        uint32_t nstates;
+        int32_t start;
+        uint32_t reverse;
+        uint32_t pad;
+} ImageDfa;
+
+/* A DFA in a loaded image */
+typedef struct Image {
+        const int32_t *next;
+        const uint8_t *flags;
+        int start;
+        bool reverse;
+} Image;
+
+static size_t
+image_align(size_t n)
+{
+        return (n + 7) & ~(size_t) 7;
+}
+
+/* dfa_match() on the table, a step per byte */
+static bool
+image_match(Image *im, const char *buf, size_t len, Budget *b)
+{
+        const unsigned char *c = (const unsigned char *) buf;
+        size_t at = im->reverse ? len - 1 : 0, step = im->reverse ? (size_t) -1 : 1;
+        size_t pos = 0, end = len;
+        int s = im->start, flags;
+
+        if (b->max - b->steps < len) end = b->max - b->steps;
+        for (;;) {
+                flags = im->flags[s];
+                if (flags & (DFA_MATCH | DFA_DEAD) || pos == end) break;
+                s = im->next[(size_t) s * 256 + c[at]];
+                at += step;
+                ++pos;
+        }
+        b->steps += pos;
+
+        if (flags & DFA_MATCH) return true;
+        if (flags & DFA_DEAD) return false;
+        if (end != len) {
+                b->exceeded = true;
+                return false;
+        }
+        return flags & DFA_MATCH_AT_END;
+}
+
+static void
+image_pad(FILE *out, size_t n)
+{
+        static const char zeros[8];
+        fwrite(zeros, 1, image_align(n) - n, out);
+}
+
+bool
+regex_serialize(Regex expr, FILE *out)
+{
+        Regex r;
+        Dfa *d;
+        ImageHeader h = { .version = IMAGE_VERSION, .endian = IMAGE_ENDIAN };
+        ImageDfa id = { 0 };
+        int32_t row[256];
+        bool ok;
+
+        if (expr.tokens == NULL) return false;
+        /* a copy to build whole, expr may be in use */
+        r = regex_compile_flags(expr.repr, expr.engine);
+        d = r.rdfa ? r.rdfa : r.dfa;
+        memcpy(h.magic, IMAGE_MAGIC, sizeof h.magic);
+        h.engine = r.engine;
+        h.patlen = strlen(r.repr);
+        h.size = sizeof h + image_align(h.patlen + 1);
+        if (d && (id.start = dfa_build(d)) >= 0) {
+                id.nstates = d->nstates;
+                id.reverse = d->nfa->reverse;
+                h.dfa = h.size;
+                h.size += sizeof id + (size_t) id.nstates * sizeof row + image_align(id.nstates);
+        }
+
+        fwrite(&h, sizeof h, 1, out);
+        fwrite(r.repr, 1, h.patlen + 1, out);
+        image_pad(out, h.patlen + 1);
+        if (h.dfa) {
+                fwrite(&id, sizeof id, 1, out);
+                for (uint32_t st = 0; st < id.nstates; st++) {
+                        /* those of MATCH and DEAD states are never read */
+                        for (int b = 0; b < 256; b++)
+                                row[b] = atomic_load(&d->states[st].next[b]);
+                        fwrite(row, sizeof row, 1, out);
+                }
+                for (uint32_t st = 0; st < id.nstates; st++)
+                        fputc(d->states[st].flags, out);
+                image_pad(out, id.nstates);
+        }
+        ok = !ferror(out);
+        regex_free(r);
+        return ok;
+}
+
+/* Whether engine is something regex_compile_flags() takes: none or one
+ * engine, maybe with REGEX_JIT */
+static bool
+image_engine(uint32_t engine)
+{
+        uint32_t e = engine & ~(uint32_t) REGEX_JIT;
+        return e == 0 || e == REGEX_BACKTRACK || e == REGEX_NFA || e == REGEX_DFA || e == REGEX_GLUSHKOV;
+}
+
+/* Checks the DFA of an image, so a corrupt one can't send a match out of
+ * the table */
+static bool
+image_check(const ImageDfa *id, const int32_t *next, const uint8_t *flags)
+{
+        if (id->nstates == 0 || id->start < 0 || (uint32_t) id->start >= id->nstates) return false;
+        for (uint32_t st = 0; st < id->nstates; st++) {
+                if (flags[st] & (DFA_MATCH | DFA_DEAD)) continue;
+                for (int b = 0; b < 256; b++) {
+                        int32_t to = next[(size_t) st * 256 + b];
+                        if (to < 0 || (uint32_t) to >= id->nstates) return false;
+                }
+        }
+        return true;
+}
+
+bool
+regex_load(const void *buf, size_t len, Regex *out)
+{
+        const char *p = buf;
+        const ImageHeader *h = buf;
+        const ImageDfa *id = NULL;
+        const int32_t *next = NULL;
+        const uint8_t *flags = NULL;
+        Image *im;
+        size_t need;
+
+        if ((uintptr_t) buf % 8 || len < sizeof *h) return false;
+        if (memcmp(h->magic, IMAGE_MAGIC, sizeof h->magic) != 0 || h->version != IMAGE_VERSION ||
+            h->endian != IMAGE_ENDIAN || h->size > len || h->size < sizeof *h || !image_engine(h->engine))
+                return false;
+        if (h->patlen >= h->size - sizeof *h || p[sizeof *h + h->patlen] != 0) return false;
+        if (h->dfa) {
+                if (h->dfa % 8 || h->dfa < sizeof *h || h->size - h->dfa < sizeof *id) return false;
+                id = (const ImageDfa *) (p + h->dfa);
+                need = sizeof *id + (size_t) id->nstates * 256 * sizeof *next + id->nstates;
+                if (id->nstates > (h->size - h->dfa) / (256 * sizeof *next) || h->size - h->dfa < need)
+                        return false;
+                next = (const int32_t *) (id + 1);
+                flags = (const uint8_t *) (next + (size_t) id->nstates * 256);
+                if (!image_check(id, next, flags)) return false;
+        }
+
+        /* the image is the DFA, unless it has none or it runs the other way */
+        *out = compile((char *) p + sizeof *h, h->engine, false);
+        if (out->engine != REGEX_DFA) return true;
+        if (h->dfa == 0 || (out->rnfa != NULL) != (id->reverse != 0)) {
+                dfa_attach(out);
+        } else {
+                im = arena_alloc(out->arena, sizeof(Image));
+                im->next = next;
+                im->flags = flags;
+                im->start = id->start;
+                im->reverse = id->reverse;
+                out->image = im;
+        }
+        return true;
+}
+
+/* Cache
+ *
+ * Compiled regexes by pattern, so a pattern given over and over is compiled
+ * once. The entries are a fixed array, found through an open addressed table
+ * of their indices. Hits take no lock: they probe the table, pin the entry
+ * with a reference and only then compare its pattern. Misses take the lock,
+ * look again and insert, evicting if the cache is full. An entry is only
+ * evicted when nobody holds it, so a hit racing with an eviction at worst
+ * misses and finds the pattern under the lock.
+ *
+ * Eviction is CLOCK, LRU as told by a bit per entry: hits set it, the hand
+ * clears it on its way and evicts the first unheld entry it finds clear.
+ */
+#define CACHE_EMPTY -1 /* slot with no entry */
+#define CACHE_FREE -1  /* refs of an entry with no regex, or being evicted */
+
+typedef struct CacheEntry {
+        Regex r; /* first, so regex_cache_release() can go back to the entry */
+        _Atomic uint64_t hash;
+        _Atomic int refs;
+        _Atomic bool used; /* hit since the hand last went by */
+        bool detached;     /* not in the cache, every entry was held */
+} CacheEntry;
+
+struct RegexCache {
+        CacheEntry *entries;
+        _Atomic int *slots; /* linear probing, never more than half full */
+        size_t cap, nslots;
+        size_t len; /* entries used so far */
+        size_t hand;
+        _Atomic size_t compiles;
+        pthread_mutex_t lock; /* misses, guards everything but refs and used */
+};
+
+static uint64_t
+cache_hash(const char *s)
+{
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (; *s; s++)
+                h = (h ^ (unsigned char) *s) * 0x100000001b3ULL;
+        return h;
+}
+
+static bool
+cache_pin(CacheEntry *e)
+{
+        int refs = atomic_load_explicit(&e->refs, memory_order_relaxed);
+        do
+                if (refs < 0) return false;
+        while (!atomic_compare_exchange_weak_explicit(&e->refs, &refs, refs + 1, memory_order_acquire,
+                                                      memory_order_relaxed));
+        return true;
+}
+
+static void
+cache_unpin(CacheEntry *e)
+{
+        atomic_fetch_sub_explicit(&e->refs, 1, memory_order_release);
+}
+
+/* The entry of expr, pinned, or NULL. May miss while the lock is held by
+ * someone else, never returns a wrong one */
+static CacheEntry *
+cache_find(RegexCache *c, const char *expr, uint64_t h)
+{
+        size_t mask = c->nslots - 1;
+        size_t i = h & mask;
+
+        for (size_t n = 0; n < c->nslots; n++, i = (i + 1) & mask) {
+                int k = atomic_load_explicit(&c->slots[i], memory_order_acquire);
+                CacheEntry *e;
+                if (k == CACHE_EMPTY) return NULL;
+                e = &c->entries[k];
+                if (atomic_load_explicit(&e->hash, memory_order_relaxed) != h || !cache_pin(e)) continue;
+                if (strcmp(e->r.repr, expr) == 0) {
+                        if (!atomic_load_explicit(&e->used, memory_order_relaxed))
+                                atomic_store_explicit(&e->used, true, memory_order_relaxed);
+                        return e;
+                }
+                cache_unpin(e);
+        }
+        return NULL;
+}
+
+/* Takes entry k out of the table, moving back the ones after it that would
+ * be out of reach. Lookups meanwhile may miss them, not find wrong ones */
+static void
+cache_unlink(RegexCache *c, int k)
+{
+        size_t mask = c->nslots - 1;
+        size_t i = atomic_load_explicit(&c->entries[k].hash, memory_order_relaxed) & mask;
+        size_t j, home;
+        int m;
+
+        while (atomic_load_explicit(&c->slots[i], memory_order_relaxed) != k)
+                i = (i + 1) & mask;
+        for (j = (i + 1) & mask; (m = atomic_load_explicit(&c->slots[j], memory_order_relaxed)) != CACHE_EMPTY;
+             j = (j + 1) & mask) {
+                home = atomic_load_explicit(&c->entries[m].hash, memory_order_relaxed) & mask;
+                if (((j - home) & mask) < ((j - i) & mask)) continue;
+                atomic_store_explicit(&c->slots[i], m, memory_order_release);
+                i = j;
+        }
+        atomic_store_explicit(&c->slots[i], CACHE_EMPTY, memory_order_release);
+}
+
+/* A free entry, evicting one by CLOCK if needed. NULL if every entry is
+ * held */
+static CacheEntry *
+cache_victim(RegexCache *c)
+{
+        CacheEntry *e;
+        int refs;
+
+        if (c->len < c->cap) return &c->entries[c->len++];
+        for (size_t n = 0; n < 2 * c->cap; n++) {
+                e = &c->entries[c->hand];
+                c->hand = (c->hand + 1) % c->cap;
+                if (atomic_exchange_explicit(&e->used, false, memory_order_relaxed)) continue;
+                refs = 0;
+                if (!atomic_compare_exchange_strong_explicit(&e->refs, &refs, CACHE_FREE, memory_order_acquire,
+                                                             memory_order_relaxed))
+                        continue;
+                cache_unlink(c, e - c->entries);
+                regex_free(e->r);
+                return e;
+        }
+        return NULL;
+}
+
+RegexCache *
+regex_cache_new(size_t capacity)
+{
+        RegexCache *c = calloc(1, sizeof(RegexCache));
+
+        c->cap = capacity;
+        for (c->nslots = 2; c->nslots < 2 * capacity; c->nslots *= 2)
+                ;
+        c->entries = calloc(capacity ? capacity : 1, sizeof(CacheEntry));
+        c->slots = malloc(c->nslots * sizeof(*c->slots));
+        for (size_t i = 0; i < capacity; i++)
+                atomic_init(&c->entries[i].refs, CACHE_FREE);
+        for (size_t i = 0; i < c->nslots; i++)
+                atomic_init(&c->slots[i], CACHE_EMPTY);
+        pthread_mutex_init(&c->lock, NULL);
+        return c;
+}
+
+const Regex *
+regex_cache_get(RegexCache *c, const char *expr)
+{
+        uint64_t h = cache_hash(expr);
+        CacheEntry *e = cache_find(c, expr, h);
+        size_t mask = c->nslots - 1;
+        bool kept = false;
+        Regex r;
+
+        if (e) return &e->r;
+        r = regex_compile((char *) expr);
+        atomic_fetch_add_explicit(&c->compiles, 1, memory_order_relaxed);
+        pthread_mutex_lock(&c->lock);
+        if ((e = cache_find(c, expr, h)) == NULL && (e = cache_victim(c)) != NULL) {
+                e->r = r;
+                atomic_store_explicit(&e->hash, h, memory_order_relaxed);
+                atomic_store_explicit(&e->used, false, memory_order_relaxed);
+                atomic_store_explicit(&e->refs, 1, memory_order_release);
+                for (size_t i = h & mask;; i = (i + 1) & mask) {
+                        if (atomic_load_explicit(&c->slots[i], memory_order_relaxed) != CACHE_EMPTY) continue;
+                        atomic_store_explicit(&c->slots[i], (int) (e - c->entries), memory_order_release);
+                        break;
+                }
+                kept = true;
+        }
+        pthread_mutex_unlock(&c->lock);
+        if (e == NULL) {
+                e = calloc(1, sizeof(CacheEntry));
+                e->r = r;
+                e->detached = true;
+        } else if (!kept) {
+                regex_free(r);
+        }
+        return &e->r;
+}
+
+void
+regex_cache_release(RegexCache *c, const Regex *r)
+{
+        CacheEntry *e = (CacheEntry *) r;
+
+        (void) c;
+        if (e->detached) {
+                regex_free(e->r);
+                free(e);
+        } else {
+                cache_unpin(e);
+        }
+}
+
+size_t
+regex_cache_compiles(RegexCache *c)
+{
+        return atomic_load_explicit(&c->compiles, memory_order_relaxed);
+}
+
+void
+regex_cache_free(RegexCache *c)
+{
+        for (size_t i = 0; i < c->len; i++)
+                regex_free(c->entries[i].r);
+        pthread_mutex_destroy(&c->lock);
+        free(c->entries);
+        free(c->slots);
+        free(c);
 }
@@ -2,7 +2,17 @@
 #define REGEX_H_
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
+/* 256-bit byte set, one bit per byte value */
+typedef struct RegexClass {
+        uint64_t bits[4];
+} RegexClass;
+
+/* Tokens of a Regex live in one array and link to each other by index into
+ * it, -1 being the end of a list */
 /* clang-format off */
 typedef struct RegexTok {
         enum {
@@ -24,33 +34,184 @@ typedef struct RegexTok {
                 struct {                                } start_of_line;
                 struct {                                } end_of_line;
                 struct {                                } any_char;
-                struct { struct RegexTok *body;         } bracket_expr;
-                struct { struct RegexTok *body; int id; } group;
-                struct { struct RegexTok *group;        } match_group;
-                struct { struct RegexTok *match;        } match_zero_more;
-                struct { struct RegexTok *match;        } match_zero_one;
-                struct { struct RegexTok *match;        } match_one_more;
-                struct { struct RegexTok *match; struct RegexTok *range; } match_range;
-                struct { struct RegexTok *left;  struct RegexTok *right; } match_or;
-                struct { char*literal;                  } literal;
+                struct { int body; RegexClass *class;   } bracket_expr;
+                struct { int body; int id;              } group;
+                struct { int group;                     } match_group;
+                struct { int match;                     } match_zero_more;
+                struct { int match;                     } match_zero_one;
+                struct { int match;                     } match_one_more;
+                struct { int match; int range; int min, max; } match_range; /* max -1: no limit */
+                struct { int left;  int right;          } match_or;
+                struct { char*literal; int len;         } literal;
         };
         char *lexeme;
-        struct RegexTok *next;
+        int next;
 } RegexTok;
 
+/* Engines, pass one of them to regex_compile_flags() to force it.
+ * REGEX_JIT goes with the DFA, which it implies, and falls back to
+ * interpreting it where there's no JIT or the DFA is too big. */
+enum {
+        REGEX_BACKTRACK = 1 << 0, /* backtracker, needed for backreferences */
+        REGEX_NFA = 1 << 1,       /* Thompson NFA simulation, linear time */
+        REGEX_DFA = 1 << 2,       /* DFA built lazily on top of the NFA */
+        REGEX_JIT = 1 << 3,       /* the DFA built whole and compiled to x86-64 */
+        REGEX_GLUSHKOV = 1 << 4,  /* bit-parallel, default for up to 64 positions */
+};
+
 typedef struct Regex {
         char *repr;
-        RegexTok *tokens;
+        RegexTok *tokens; /* the expression starts at tokens[0] */
+        int ntokens;
+        int engine;
+        struct Nfa *nfa;
+        struct Dfa *dfa;
+        struct Nfa *rnfa; /* backwards, if the pattern ends in $ and has no ^ */
+        struct Dfa *rdfa;
+        struct Jit *jit; /* of rdfa if there is one, else of dfa */
+        struct Glushkov *glushkov;
+        struct Counters *counters; /* REGEX_STATS builds only, NULL otherwise */
+        struct Image *image; /* DFA of a regex_load()ed image, in the image */
+        struct Prefilter *prefilter;
+        size_t minlen;     /* of any match */
+        size_t maxlen;     /* REGEX_UNSET if there's no limit */
+        RegexClass *first; /* bytes a match can start with, NULL for any */
+        int ngroups; /* capture groups, not counting the whole match */
+        struct Arena *arena; /* owns everything above */
 } Regex;
 
+/* Many patterns matched in a single pass over the input */
+typedef struct RegexSet {
+        int len;
+        struct Nfa *nfa; /* the patterns that aren't plain strings, merged */
+        struct Dfa *dfa;
+        struct AhoCorasick *ac; /* the plain strings */
+        struct Arena *arena;
+} RegexSet;
+
+/* Span of buf, [start, end). Both are REGEX_UNSET for a group that took no
+ * part in the match */
+typedef struct RegexMatch {
+        size_t start;
+        size_t end;
+} RegexMatch;
+
+#define REGEX_UNSET ((size_t) -1)
+
+/* How regex_match_limited() went */
+typedef struct RegexStatus {
+        enum {
+                REGEX_OK,
+                REGEX_BUDGET_EXCEEDED, /* gave up, the answer is unknown */
+        } code;
+        uint64_t steps; /* work done */
+} RegexStatus;
+
+/* Work done by the matches of a Regex so far, see regex_stats() */
+typedef struct RegexStats {
+        uint64_t evals[MATCH_OR + 1]; /* tokens tried by the backtracker, by type */
+        uint64_t backtracks;          /* repetitions giving back a match of their body */
+        uint64_t starts;              /* offsets the backtracker tried a match from */
+        uint64_t prefilter_hits;      /* searches for the required literal that found it */
+        uint64_t prefilter_misses;    /* and that didn't, ruling the input out */
+        uint64_t dfa_flushes;         /* counted in every build */
+} RegexStats;
 
-/* Core functions */
+/* Walks the non-overlapping matches of expr in buf, see regex_iter_next() */
+typedef struct RegexIter {
+        Regex expr;
+        const char *buf;
+        size_t len;
+        size_t pos;      /* where the next search starts */
+        size_t last_end; /* end of the last match */
+        size_t hint;     /* last prefilter hit */
+} RegexIter;
+
+/* Core functions
+ *
+ * A Regex is never modified by matching once regex_compile() returns, so one
+ * compiled Regex can be shared between threads without locking. The only
+ * state that changes is the DFA cache, which synchronizes itself.
+ */
 Regex regex_compile(char *expr);
+Regex regex_compile_flags(char *expr, int flags);
+void regex_free(Regex expr);
 bool regex_match(Regex expr, char *str);
+bool regex_match_n(Regex expr, const char *buf, size_t len);
+/* regex_match_n() that gives up and returns false after max_steps steps of
+ * work: a token tried by the backtracker, a byte plus one per state stepped
+ * on it for the NFA, a byte for the DFA and the Glushkov automaton. status
+ * may be NULL. */
+bool regex_match_limited(Regex expr, const char *buf, size_t len, uint64_t max_steps, RegexStatus *status);
+/* regex_match_n() of n inputs, strs[i] being lens[i] bytes long. Sets
+ * results[i] to whether it matched and returns how many did. Faster than
+ * as many calls, the DFA walks several inputs at once. */
+size_t regex_match_batch(Regex expr, const char **strs, const size_t *lens, size_t n, uint8_t *results);
+/* Leftmost-first match of expr in buf. groups[0] gets the whole match and
+ * groups[i] the i-th parenthesized group, by order of their `(`. */
+bool regex_exec(Regex expr, const char *buf, size_t len, RegexMatch *groups, int ngroups);
+/* Like regex_exec(), for the first match that starts at or after start */
+bool regex_find_next(Regex expr, const char *buf, size_t len, size_t start, RegexMatch *out);
+/* Every match, leftmost-first, in one pass over buf. An empty match right
+ * after the previous match is skipped. */
+RegexIter regex_iter(Regex expr, const char *buf, size_t len);
+bool regex_iter_next(RegexIter *it, RegexMatch *out);
+
+/* Matching input that comes in chunks. on_match gets every match, with
+ * offsets from the start of the stream, as soon as it ends: matches are the
+ * shortest ones and don't overlap. regex_stream_end() reports the ones that
+ * need the end of the input, like `$`, and frees the stream. */
+typedef struct RegexStream RegexStream;
+RegexStream *regex_stream_begin(Regex expr, void (*on_match)(RegexMatch match, void *data), void *data);
+void regex_stream_feed(RegexStream *stream, const char *buf, size_t len);
+void regex_stream_end(RegexStream *stream);
+
+/* Sets bit i of matched, matched[i / 64] >> i % 64, if exprs[i] matches buf.
+ * matched holds (count + 63) / 64 words. Returns whether any did. */
+RegexSet regex_set_compile(char **exprs, int count);
+bool regex_set_match(RegexSet set, const char *buf, size_t len, uint64_t *matched);
+void regex_set_free(RegexSet set);
+
+/* Writes a C function `bool name(const char *buf, size_t len)` that tells
+ * whether expr matches buf, like regex_match_n(), from the whole DFA of
+ * expr. It needs <stdbool.h>, <stddef.h> and <stdint.h>. Returns false if
+ * expr is empty or its DFA doesn't fit in REGEX_DFA_CACHE_SIZE. */
+bool regex_codegen(char *expr, const char *name, FILE *out);
+
+/* Writes expr to out as an image regex_load() can use in place, with its
+ * whole DFA if it fits in REGEX_DFA_CACHE_SIZE. Images have no pointers,
+ * so a file of them can be mmapped anywhere and shared by processes.
+ * Returns false if expr is empty or writing fails. */
+bool regex_serialize(Regex expr, FILE *out);
+/* The Regex in the image at buf, which must be 8-byte aligned and outlive
+ * it. Returns false if buf isn't a valid image of this version. The pattern
+ * in it is parsed again like regex_compile() does, which exits on patterns
+ * it doesn't support, so images must come from regex_serialize() or a
+ * trusted source. */
+bool regex_load(const void *buf, size_t len, Regex *out);
+
+/* Compiled regexes by pattern, up to capacity of them, evicting by CLOCK,
+ * an approximation of LRU. regex_cache_get() compiles expr on a miss, a
+ * hit is a hash lookup with no lock. The Regex is the same for every
+ * caller, held until regex_cache_release() and never evicted meanwhile. If
+ * every entry is held the Regex is compiled for the caller alone. Thread safe, but
+ * regex_cache_free() wants every Regex released. */
+typedef struct RegexCache RegexCache;
+RegexCache *regex_cache_new(size_t capacity);
+const Regex *regex_cache_get(RegexCache *cache, const char *expr);
+void regex_cache_release(RegexCache *cache, const Regex *expr);
+/* Times a pattern was compiled, on misses, to tell if capacity is enough */
+size_t regex_cache_compiles(RegexCache *cache);
+void regex_cache_free(RegexCache *cache);
 
 /* Info functions */
 char * regex_repr(Regex expr);
 void print_token_ast(Regex r);
+/* Fills stats. Returns false, with only dfa_flushes counted, unless the
+ * library was built with -DREGEX_STATS */
+bool regex_stats(Regex expr, RegexStats *stats);
+/* print_token_ast() with the evals of each token next to it */
+void print_token_stats(Regex r);
 
 
 #endif // !REGEX_H_
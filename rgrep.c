@@ -0,0 +1,295 @@
+/* rgrep: grep on top of regex.c
+ *
+ * Files are mmap'd and cut into chunks that end at a newline. A pool of
+ * threads matches the lines of the chunks, sharing one compiled Regex, and
+ * the main thread prints the results of each chunk in order as soon as it
+ * is done.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "regex.h"
+
+#define CHUNK_SIZE (1 << 20)
+
+typedef struct Options {
+        bool count;
+        bool number;
+        bool invert;
+        bool list;
+        int jobs;
+        bool show_name;
+} Options;
+
+typedef struct Line {
+        size_t start;
+        size_t len; /* without the newline */
+        size_t number; /* from the start of the chunk */
+} Line;
+
+typedef struct Chunk {
+        size_t start;
+        size_t end;
+        Line *lines; /* the ones selected */
+        size_t nlines;
+        size_t cap;
+        size_t total; /* lines in the chunk */
+        bool done;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+} Chunk;
+
+typedef struct File {
+        Regex regex;
+        Options *opts;
+        const char *buf;
+        size_t len;
+        Chunk *chunks;
+        size_t nchunks;
+        atomic_size_t next; /* next chunk to be taken by a worker */
+        atomic_bool found;  /* for -l, stop as soon as anything matches */
+} File;
+
+static void
+chunk_add(Chunk *c, size_t start, size_t len, size_t number)
+{
+        if (c->nlines == c->cap) {
+                c->cap = c->cap ? c->cap * 2 : 64;
+                c->lines = realloc(c->lines, c->cap * sizeof *c->lines);
+        }
+        c->lines[c->nlines++] = (Line) { start, len, number };
+}
+
+static void
+match_chunk(File *f, Chunk *c)
+{
+        const char *p = f->buf + c->start;
+        const char *end = f->buf + c->end;
+        size_t number = 0;
+
+        while (p < end) {
+                const char *nl = memchr(p, '\n', end - p);
+                size_t len = (nl ? nl : end) - p;
+                if (f->opts->list && atomic_load_explicit(&f->found, memory_order_relaxed))
+                        break;
+                if (regex_match_n(f->regex, p, len) != f->opts->invert) {
+                        if (f->opts->list) atomic_store(&f->found, true);
+                        chunk_add(c, p - f->buf, len, number);
+                }
+                ++number;
+                p += len + 1;
+        }
+        c->total = number;
+}
+
+static void *
+worker(void *arg)
+{
+        File *f = arg;
+        size_t i;
+
+        while ((i = atomic_fetch_add(&f->next, 1)) < f->nchunks) {
+                Chunk *c = &f->chunks[i];
+                match_chunk(f, c);
+                pthread_mutex_lock(&c->lock);
+                c->done = true;
+                pthread_cond_signal(&c->cond);
+                pthread_mutex_unlock(&c->lock);
+        }
+        return NULL;
+}
+
+/* Cut buf in chunks of about CHUNK_SIZE bytes that end after a newline */
+static size_t
+split(const char *buf, size_t len, Chunk **chunks)
+{
+        size_t n = 0, cap = len / CHUNK_SIZE + 1;
+        size_t start = 0;
+
+        *chunks = calloc(cap, sizeof(Chunk));
+        while (start < len) {
+                size_t end = start + CHUNK_SIZE;
+                if (end >= len) {
+                        end = len;
+                } else {
+                        const char *nl = memchr(buf + end, '\n', len - end);
+                        end = nl ? (size_t) (nl - buf) + 1 : len;
+                }
+                if (n == cap) {
+                        cap *= 2;
+                        *chunks = realloc(*chunks, cap * sizeof(Chunk));
+                }
+                (*chunks)[n++] = (Chunk) { .start = start, .end = end };
+                start = end;
+        }
+        return n;
+}
+
+/* Returns the number of lines selected */
+static size_t
+grep(Regex regex, Options *opts, const char *name, const char *buf, size_t len)
+{
+        File f = { .regex = regex, .opts = opts, .buf = buf, .len = len };
+        pthread_t *threads = malloc(opts->jobs * sizeof(pthread_t));
+        size_t selected = 0, line = 1;
+
+        f.nchunks = split(buf, len, &f.chunks);
+        atomic_init(&f.next, 0);
+        atomic_init(&f.found, false);
+        for (size_t i = 0; i < f.nchunks; i++) {
+                pthread_mutex_init(&f.chunks[i].lock, NULL);
+                pthread_cond_init(&f.chunks[i].cond, NULL);
+        }
+        for (int i = 0; i < opts->jobs; i++)
+                pthread_create(&threads[i], NULL, worker, &f);
+
+        for (size_t i = 0; i < f.nchunks; i++) {
+                Chunk *c = &f.chunks[i];
+                pthread_mutex_lock(&c->lock);
+                while (!c->done)
+                        pthread_cond_wait(&c->cond, &c->lock);
+                pthread_mutex_unlock(&c->lock);
+
+                selected += c->nlines;
+                for (size_t k = 0; !opts->count && !opts->list && k < c->nlines; k++) {
+                        Line *l = &c->lines[k];
+                        if (opts->show_name) printf("%s:", name);
+                        if (opts->number) printf("%zu:", line + l->number);
+                        fwrite(buf + l->start, 1, l->len, stdout);
+                        putchar('\n');
+                }
+                line += c->total;
+                free(c->lines);
+        }
+
+        for (int i = 0; i < opts->jobs; i++)
+                pthread_join(threads[i], NULL);
+        for (size_t i = 0; i < f.nchunks; i++) {
+                pthread_mutex_destroy(&f.chunks[i].lock);
+                pthread_cond_destroy(&f.chunks[i].cond);
+        }
+        free(f.chunks);
+        free(threads);
+
+        if (opts->count) {
+                if (opts->show_name) printf("%s:", name);
+                printf("%zu\n", selected);
+        }
+        if (opts->list && selected)
+                printf("%s\n", name);
+        return selected;
+}
+
+static char *
+read_all(FILE *fp, size_t *len)
+{
+        size_t cap = 1 << 16;
+        char *buf = malloc(cap);
+        size_t n;
+
+        *len = 0;
+        while ((n = fread(buf + *len, 1, cap - *len, fp)) > 0) {
+                *len += n;
+                if (*len == cap) buf = realloc(buf, cap *= 2);
+        }
+        return buf;
+}
+
+/* -1 if name can't be read */
+static long
+grep_file(Regex regex, Options *opts, const char *name)
+{
+        struct stat st;
+        size_t selected;
+        char *buf;
+        int fd;
+
+        if (strcmp(name, "-") == 0) {
+                size_t len;
+                buf = read_all(stdin, &len);
+                selected = grep(regex, opts, "(standard input)", buf, len);
+                free(buf);
+                return selected;
+        }
+
+        if ((fd = open(name, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+                fprintf(stderr, "rgrep: %s: %s\n", name, strerror(errno));
+                if (fd >= 0) close(fd);
+                return -1;
+        }
+        if (st.st_size == 0) {
+                close(fd);
+                return grep(regex, opts, name, "", 0);
+        }
+        buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (buf == MAP_FAILED) {
+                fprintf(stderr, "rgrep: %s: %s\n", name, strerror(errno));
+                return -1;
+        }
+        madvise(buf, st.st_size, MADV_SEQUENTIAL);
+        selected = grep(regex, opts, name, buf, st.st_size);
+        munmap(buf, st.st_size);
+        return selected;
+}
+
+static void
+usage()
+{
+        fprintf(stderr, "Usage: rgrep [-cnvl] [-j N] PATTERN [FILE...]\n");
+        exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+        Options opts = { .jobs = sysconf(_SC_NPROCESSORS_ONLN) };
+        bool selected = false, error = false;
+        Regex regex;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "cnvlj:")) != -1) {
+                switch (opt) {
+                case 'c':
+                        opts.count = true;
+                        break;
+                case 'n':
+                        opts.number = true;
+                        break;
+                case 'v':
+                        opts.invert = true;
+                        break;
+                case 'l':
+                        opts.list = true;
+                        break;
+                case 'j':
+                        opts.jobs = atoi(optarg);
+                        break;
+                default:
+                        usage();
+                }
+        }
+        if (optind >= argc) usage();
+        if (opts.jobs < 1) opts.jobs = 1;
+
+        regex = regex_compile(argv[optind++]);
+        opts.show_name = argc - optind > 1;
+        if (optind == argc) argv[--optind] = "-";
+
+        for (; optind < argc; optind++) {
+                long n = grep_file(regex, &opts, argv[optind]);
+                if (n < 0) error = true;
+                if (n > 0) selected = true;
+        }
+        regex_free(regex);
+        return error ? 2 : selected ? 0 : 1;
+}
@@ -1,4 +1,11 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "regex.h"
 
@@ -7,20 +14,48 @@
 #define GREEN "\033[32m"
 #define RESET "\033[0m"
 
+static const struct {
+        int flags;
+        char *name;
+} ENGINES[] = {
+        { REGEX_BACKTRACK, "backtrack" },
+        { REGEX_NFA, "nfa" },
+        { REGEX_DFA, "dfa" },
+        { REGEX_JIT, "jit" },
+        { REGEX_GLUSHKOV, "glushkov" },
+};
+
+/* Returns the name of the first engine that disagrees with expected. The
+ * test helpers below take ownership of regex and free it. */
+static char *
+check_engines(Regex regex, const char *buf, size_t len, bool expected)
+{
+        if (regex_match_n(regex, buf, len) != expected) return "default";
+        for (size_t i = 0; i < sizeof ENGINES / sizeof *ENGINES; i++) {
+                Regex r = regex_compile_flags(regex_repr(regex), ENGINES[i].flags);
+                bool ok = regex_match_n(r, buf, len) == expected;
+                regex_free(r);
+                if (!ok) return ENGINES[i].name;
+        }
+        return NULL;
+}
+
 static void
 test(Regex regex, char *str)
 {
         static int done = 0;
         static int passed = 0;
+        char *engine;
         done++;
-        if (!regex_match(regex, str)) {
-                printf(RED "Test [%d/%d] Fail: \"%s\" don't match regex \"%s\"\n" RESET, done, passed, str, regex_repr(regex));
+        if ((engine = check_engines(regex, str, strlen(str), true))) {
+                printf(RED "Test [%d/%d] Fail: \"%s\" don't match regex \"%s\" (%s)\n" RESET, done, passed, str, regex_repr(regex), engine);
         } else {
                 passed++;
 #if !defined(HIDE_PASSED) || !HIDE_PASSED
                 printf(GREEN "Test [%d/%d] Ok\n" RESET, done, passed);
 #endif
         }
+        regex_free(regex);
 }
 
 static void
@@ -28,9 +63,769 @@ test_not(Regex regex, char *str)
 {
         static int done = 0;
         static int passed = 0;
+        char *engine;
+        done++;
+        if ((engine = check_engines(regex, str, strlen(str), false))) {
+                printf(RED "Test [%d/%d] Fail: \"%s\" match regex \"%s\" (%s)\n" RESET, done, passed, str, regex_repr(regex), engine);
+        } else {
+                passed++;
+#if !defined(HIDE_PASSED) || !HIDE_PASSED
+                printf(GREEN "Test [%d/%d] Ok\n" RESET, done, passed);
+#endif
+        }
+        regex_free(regex);
+}
+
+/* Matches against the first len bytes of buf, which can hold NULs */
+static void
+test_n(Regex regex, const char *buf, size_t len, bool expected)
+{
+        static int done = 0;
+        static int passed = 0;
+        char *engine;
+        done++;
+        if ((engine = check_engines(regex, buf, len, expected))) {
+                printf(RED "Test [%d/%d] Fail: \"%.*s\" %s regex \"%s\" (%s)\n" RESET, done, passed, (int) len, buf, expected ? "don't match" : "match", regex_repr(regex), engine);
+        } else {
+                passed++;
+#if !defined(HIDE_PASSED) || !HIDE_PASSED
+                printf(GREEN "Test [%d/%d] Ok\n" RESET, done, passed);
+#endif
+        }
+        regex_free(regex);
+}
+
+/* For inputs that only make sense on some engines */
+static void
+test_engine(int flags, char *expr, char *str, bool expected)
+{
+        static int done = 0;
+        static int passed = 0;
+        Regex regex = regex_compile_flags(expr, flags);
         done++;
-        if (regex_match(regex, str)) {
-                printf(RED "Test [%d/%d] Fail: \"%s\" match regex \"%s\"\n" RESET, done, passed, str, regex_repr(regex));
+        if (regex_match(regex, str) != expected) {
+                printf(RED "Test [%d/%d] Fail: \"%.20s...\" %s regex \"%s\"\n" RESET, done, passed, str, expected ? "don't match" : "match", expr);
+        } else {
+                passed++;
+#if !defined(HIDE_PASSED) || !HIDE_PASSED
+                printf(GREEN "Test [%d/%d] Ok\n" RESET, done, passed);
+#endif
+        }
+        regex_free(regex);
+}
+
+static char *
+repeat(char *s, int n)
+{
+        static char buf[1 << 16];
+        int len = strlen(s);
+        assert(n * len < (int) sizeof buf);
+        for (int i = 0; i < n; i++)
+                memcpy(buf + i * len, s, len);
+        buf[n * len] = 0;
+        return buf;
+}
+
+/* Pseudo random string over alphabet, always the same */
+static char *
+noise(char *alphabet, int n)
+{
+        static char buf[1 << 16];
+        unsigned x = 12345;
+        int k = strlen(alphabet);
+        assert(n < (int) sizeof buf);
+        for (int i = 0; i < n; i++) {
+                x = x * 1103515245 + 12345;
+                buf[i] = alphabet[(x >> 16) % k];
+        }
+        buf[n] = 0;
+        return buf;
+}
+
+/* spans holds start, end for each group, -1 for unset. NULL: no match */
+static void
+test_exec(char *expr, char *str, int ngroups, const long *spans)
+{
+        static int done = 0;
+        static int passed = 0;
+        RegexMatch groups[16];
+        bool ok = true;
+        done++;
+        assert(ngroups <= 16);
+        for (size_t e = 0; e <= sizeof ENGINES / sizeof *ENGINES; e++) {
+                Regex regex = regex_compile_flags(expr, e ? ENGINES[e - 1].flags : 0);
+                bool matched = regex_exec(regex, str, strlen(str), groups, ngroups);
+                regex_free(regex);
+                if (matched != (spans != NULL)) ok = false;
+                for (int i = 0; spans && matched && i < ngroups; i++)
+                        if (groups[i].start != (size_t) spans[2 * i] ||
+                            groups[i].end != (size_t) spans[2 * i + 1])
+                                ok = false;
+        }
+        if (!ok) {
+                printf(RED "Test [%d/%d] Fail: wrong submatches of \"%s\" in \"%s\"\n" RESET, done, passed, expr, str);
+        } else {
+                passed++;
+#if !defined(HIDE_PASSED) || !HIDE_PASSED
+                printf(GREEN "Test [%d/%d] Ok\n" RESET, done, passed);
+#endif
+        }
+}
+
+/* spans holds start, end of every match regex_iter_next() should return,
+ * ended by -1 */
+static void
+test_iter(char *expr, char *str, const long *spans)
+{
+        static int done = 0;
+        static int passed = 0;
+        RegexMatch m;
+        bool ok = true;
+        done++;
+        for (size_t e = 0; e <= sizeof ENGINES / sizeof *ENGINES; e++) {
+                Regex regex = regex_compile_flags(expr, e ? ENGINES[e - 1].flags : 0);
+                RegexIter it = regex_iter(regex, str, strlen(str));
+                const long *span = spans;
+                while (regex_iter_next(&it, &m)) {
+                        if (*span == -1 || m.start != (size_t) span[0] || m.end != (size_t) span[1]) {
+                                ok = false;
+                                break;
+                        }
+                        span += 2;
+                }
+                if (*span != -1) ok = false;
+                regex_free(regex);
+        }
+        if (!ok) {
+                printf(RED "Test [%d/%d] Fail: wrong matches of \"%s\" in \"%s\"\n" RESET, done, passed, expr, str);
+        } else {
+                passed++;
+#if !defined(HIDE_PASSED) || !HIDE_PASSED
+                printf(GREEN "Test [%d/%d] Ok\n" RESET, done, passed);
+#endif
+        }
+}
+
+/* The set has to agree with matching every pattern on its own */
+static void
+test_set(char **exprs, int count, char *str)
+{
+        static int done = 0;
+        static int passed = 0;
+        RegexSet set = regex_set_compile(exprs, count);
+        uint64_t matched[8];
+        bool ok = true;
+        done++;
+        assert(count <= 8 * 64);
+        for (int round = 0; round < 2; round++) { /* cold and warm cache */
+                bool any = regex_set_match(set, str, strlen(str), matched);
+                bool expected_any = false;
+                for (int i = 0; i < count; i++) {
+                        Regex regex = regex_compile(exprs[i]);
+                        bool expected = regex_match(regex, str);
+                        regex_free(regex);
+                        expected_any = expected_any || expected;
+                        if (((matched[i / 64] >> i % 64) & 1) != expected) ok = false;
+                }
+                if (any != expected_any) ok = false;
+        }
+        regex_set_free(set);
+        if (!ok) {
+                printf(RED "Test [%d/%d] Fail: set of %d patterns disagrees on \"%.20s\"\n" RESET, done, passed, count, str);
+        } else {
+                passed++;
+#if !defined(HIDE_PASSED) || !HIDE_PASSED
+                printf(GREEN "Test [%d/%d] Ok\n" RESET, done, passed);
+#endif
+        }
+}
+
+typedef struct StreamSpans {
+        long spans[64];
+        int n;
+} StreamSpans;
+
+static void
+stream_collect(RegexMatch m, void *data)
+{
+        StreamSpans *got = data;
+        if (got->n < 62) {
+                got->spans[got->n++] = m.start;
+                got->spans[got->n++] = m.end;
+        }
+}
+
+/* Feeds str in chunks of several sizes, spans as in test_iter() */
+static void
+test_stream(char *expr, char *str, const long *spans)
+{
+        static int done = 0;
+        static int passed = 0;
+        size_t len = strlen(str);
+        size_t chunks[] = { 1, 2, 5, len ? len : 1 };
+        Regex regex = regex_compile(expr);
+        bool ok = true;
+        done++;
+        for (size_t c = 0; c < sizeof chunks / sizeof *chunks; c++) {
+                StreamSpans got = { .n = 0 };
+                RegexStream *stream = regex_stream_begin(regex, stream_collect, &got);
+                for (size_t o = 0; o < len; o += chunks[c])
+                        regex_stream_feed(stream, str + o, o + chunks[c] < len ? chunks[c] : len - o);
+                regex_stream_end(stream);
+                for (int i = 0; i <= got.n; i++)
+                        if (i == got.n ? spans[i] != -1 : spans[i] != got.spans[i]) {
+                                ok = false;
+                                break;
+                        }
+        }
+        regex_free(regex);
+        if (!ok) {
+                printf(RED "Test [%d/%d] Fail: wrong stream matches of \"%s\" in \"%s\"\n" RESET, done, passed, expr, str);
+        } else {
+                passed++;
+#if !defined(HIDE_PASSED) || !HIDE_PASSED
+                printf(GREEN "Test [%d/%d] Ok\n" RESET, done, passed);
+#endif
+        }
+}
+
+typedef struct SharedJob {
+        Regex regex;
+        char **strs;
+        bool *expected;
+        int n;
+        int first;
+        int fails;
+} SharedJob;
+
+static void *
+shared_worker(void *arg)
+{
+        SharedJob *job = arg;
+        for (int round = 0; round < 4; round++)
+                for (int i = 0; i < job->n; i++) {
+                        int k = (job->first + i) % job->n;
+                        if (regex_match(job->regex, job->strs[k]) != job->expected[k])
+                                job->fails++;
+                }
+        return NULL;
+}
+
+/* Share one compiled regex between threads, with no locking on our side */
+static void
+test_threads(char *expr, int flags)
+{
+        static int done = 0;
+        static int passed = 0;
+        enum { NTHREADS = 8, NSTRS = 64 };
+        char *strs[NSTRS];
+        bool expected[NSTRS];
+        pthread_t threads[NTHREADS];
+        SharedJob jobs[NTHREADS];
+        Regex shared = regex_compile_flags(expr, flags);
+        Regex reference = regex_compile_flags(expr, flags);
+        char *buf = noise("ab", NSTRS * 97 + 3000);
+        int fails = 0;
+
+        done++;
+        for (int i = 0; i < NSTRS; i++) {
+                strs[i] = strndup(buf + i * 97, 200 + i * 37);
+                expected[i] = regex_match(reference, strs[i]);
+        }
+        for (int i = 0; i < NTHREADS; i++) {
+                jobs[i] = (SharedJob) { shared, strs, expected, NSTRS, i * 7, 0 };
+                pthread_create(&threads[i], NULL, shared_worker, &jobs[i]);
+        }
+        for (int i = 0; i < NTHREADS; i++) {
+                pthread_join(threads[i], NULL);
+                fails += jobs[i].fails;
+        }
+        for (int i = 0; i < NSTRS; i++)
+                free(strs[i]);
+        regex_free(shared);
+        regex_free(reference);
+
+        if (fails) {
+                printf(RED "Test [%d/%d] Fail: %d wrong results sharing regex \"%s\" between threads\n" RESET, done, passed, fails, expr);
+        } else {
+                passed++;
+#if !defined(HIDE_PASSED) || !HIDE_PASSED
+                printf(GREEN "Test [%d/%d] Ok\n" RESET, done, passed);
+#endif
+        }
+}
+
+typedef struct StackJob {
+        Regex regex;
+        const char *buf;
+        size_t len;
+        bool matched;
+} StackJob;
+
+static void *
+stack_worker(void *arg)
+{
+        StackJob *job = arg;
+        job->matched = regex_match_n(job->regex, job->buf, job->len);
+        return NULL;
+}
+
+/* Backtrack over len bytes of "ab"s on a thread with a small stack */
+static void
+test_stack(char *expr, size_t len, bool expected)
+{
+        static int done = 0;
+        static int passed = 0;
+        StackJob job = { regex_compile_flags(expr, REGEX_BACKTRACK), malloc(len), len, !expected };
+        pthread_attr_t attr;
+        pthread_t thread;
+
+        done++;
+        for (size_t i = 0; i < len; i++)
+                ((char *) job.buf)[i] = "ab"[i % 2];
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, 64 << 10);
+        pthread_create(&thread, &attr, stack_worker, &job);
+        pthread_join(thread, NULL);
+        pthread_attr_destroy(&attr);
+        if (job.matched != expected) {
+                printf(RED "Test [%d/%d] Fail: regex \"%s\" on %zu bytes on a small stack\n" RESET, done, passed, expr, len);
+        } else {
+                passed++;
+#if !defined(HIDE_PASSED) || !HIDE_PASSED
+                printf(GREEN "Test [%d/%d] Ok\n" RESET, done, passed);
+#endif
+        }
+        free((char *) job.buf);
+        regex_free(job.regex);
+}
+
+/* regex_match_limited() with at most max steps on engine flags */
+static void
+test_limited(int flags, char *expr, char *str, uint64_t max, bool expected, unsigned code)
+{
+        static int done = 0;
+        static int passed = 0;
+        Regex regex = regex_compile_flags(expr, flags);
+        RegexStatus status;
+        bool matched = regex_match_limited(regex, str, strlen(str), max, &status);
+        done++;
+        if (matched != expected || status.code != code || status.steps > max ||
+            (code == REGEX_OK && status.steps == 0)) {
+                printf(RED "Test [%d/%d] Fail: regex \"%s\" on \"%.20s...\" with %lu steps: matched %d, code %d, %lu steps\n" RESET,
+                       done, passed, expr, str, (unsigned long) max, matched, status.code, (unsigned long) status.steps);
+        } else {
+                passed++;
+#if !defined(HIDE_PASSED) || !HIDE_PASSED
+                printf(GREEN "Test [%d/%d] Ok\n" RESET, done, passed);
+#endif
+        }
+        regex_free(regex);
+}
+
+/* minlen, maxlen (-1 for none) and the bytes in first, NULL for no first */
+static void
+test_span(char *expr, long min, long max, char *first)
+{
+        static int done = 0;
+        static int passed = 0;
+        Regex r = regex_compile(expr);
+        bool ok = r.minlen == (size_t) min && r.maxlen == (max < 0 ? REGEX_UNSET : (size_t) max);
+
+        done++;
+        if (first == NULL) {
+                ok = ok && r.first == NULL;
+        } else if (r.first == NULL) {
+                ok = false;
+        } else {
+                for (int c = 1; c < 256; c++) {
+                        bool has = r.first->bits[c >> 6] >> (c & 63) & 1;
+                        ok = ok && has == (strchr(first, c) != NULL);
+                }
+        }
+        if (!ok) {
+                printf(RED "Test [%d/%d] Fail: regex \"%s\" spans [%zu, %zu]\n" RESET, done, passed, expr, r.minlen, r.maxlen);
+        } else {
+                passed++;
+#if !defined(HIDE_PASSED) || !HIDE_PASSED
+                printf(GREEN "Test [%d/%d] Ok\n" RESET, done, passed);
+#endif
+        }
+        regex_free(r);
+}
+
+/* Runs argv with no shell, its output going to out, if there's room, and
+ * its errors nowhere. Returns its exit status, 127 if it couldn't start */
+static int
+run(char **argv, char *out, size_t size)
+{
+        int fds[2], status;
+        size_t got = 0;
+        ssize_t n;
+        char skip[256];
+        pid_t pid;
+
+        if (pipe(fds) != 0) return 127;
+        if ((pid = fork()) == 0) {
+                dup2(fds[1], STDOUT_FILENO);
+                dup2(fds[1], STDERR_FILENO);
+                close(fds[0]);
+                close(fds[1]);
+                execvp(argv[0], argv);
+                _exit(127);
+        }
+        close(fds[1]);
+        while (got + 1 < size && (n = read(fds[0], out + got, size - got - 1)) > 0)
+                got += n;
+        out[got] = 0;
+        while (read(fds[0], skip, sizeof skip) > 0)
+                ;
+        close(fds[0]);
+        if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) return 127;
+        return WEXITSTATUS(status);
+}
+
+/* Whether the matcher regex_codegen() wrote to out builds and agrees with
+ * regex_match_n() on the strings of strs, separated by spaces. True with no
+ * cc to build it */
+static bool
+codegen_runs(char *expr, char *out, char *strs)
+{
+        char dir[] = "/tmp/regex_codegen_XXXXXX";
+        char src[64], bin[64], got[64], expected[64] = { 0 };
+        char *cc[] = { "cc", "-Wall", "-Werror", "-o", bin, src, NULL };
+        char *version[] = { "cc", "--version", NULL };
+        char *args[64] = { bin };
+        Regex r;
+        size_t n = 0;
+        bool ok = false;
+        FILE *f;
+
+        if (run(version, got, sizeof got) != 0) return true;
+        if (mkdtemp(dir) == NULL) return false;
+        snprintf(src, sizeof src, "%s/m.c", dir);
+        snprintf(bin, sizeof bin, "%s/m", dir);
+        f = fopen(src, "w");
+        fprintf(f, "#include <stdbool.h>\n#include <stddef.h>\n#include <stdint.h>\n");
+        fprintf(f, "#include <stdio.h>\n#include <string.h>\n\n%s\n", out);
+        fprintf(f, "int\nmain(int argc, char **argv)\n{\n");
+        fprintf(f, "        for (int i = 1; i < argc; i++)\n");
+        fprintf(f, "                putchar('0' + matcher(argv[i], strlen(argv[i])));\n");
+        fprintf(f, "        return 0;\n}\n");
+        fclose(f);
+
+        r = regex_compile(expr);
+        for (char *s = strs; *s; n++) {
+                size_t l = strcspn(s, " ");
+                args[n + 1] = strndup(s, l);
+                expected[n] = '0' + regex_match_n(r, s, l);
+                s += l + (s[l] == ' ');
+        }
+        if (run(cc, got, sizeof got) == 0 && run(args, got, sizeof got) == 0)
+                ok = strcmp(got, expected) == 0;
+        for (size_t i = 1; i <= n; i++)
+                free(args[i]);
+        regex_free(r);
+        unlink(bin);
+        unlink(src);
+        rmdir(dir);
+        return ok;
+}
+
+/* regex_codegen() into memory, expected tells if it should work. The
+ * matcher is then built and run on strs */
+static void
+test_codegen(char *expr, bool expected, char *strs)
+{
+        static int done = 0;
+        static int passed = 0;
+        char *out = NULL;
+        size_t len = 0;
+        FILE *f = open_memstream(&out, &len);
+        bool ok = regex_codegen(expr, "matcher", f);
+
+        fclose(f);
+        done++;
+        if (ok != expected || (ok && strstr(out, "bool\nmatcher(const char *buf, size_t len)\n{") == NULL) ||
+            (ok && !codegen_runs(expr, out, strs))) {
+                printf(RED "Test [%d/%d] Fail: regex_codegen() on \"%s\"\n" RESET, done, passed, expr);
+        } else {
+                passed++;
+#if !defined(HIDE_PASSED) || !HIDE_PASSED
+                printf(GREEN "Test [%d/%d] Ok\n" RESET, done, passed);
+#endif
+        }
+        free(out);
+}
+
+/* Counters of the backtracker after matching str once. Without
+ * REGEX_STATS, only that regex_stats() says it has none */
+static void
+test_stats(char *expr, char *str, uint64_t starts, uint64_t backtracks, uint64_t hits, uint64_t misses)
+{
+        static int done = 0;
+        static int passed = 0;
+        Regex r = regex_compile_flags(expr, REGEX_BACKTRACK);
+        RegexStats s;
+        bool ok;
+
+        regex_match(r, str);
+#ifdef REGEX_STATS
+        ok = regex_stats(r, &s) && s.starts == starts && s.backtracks == backtracks &&
+             s.prefilter_hits == hits && s.prefilter_misses == misses;
+#else
+        (void) starts, (void) backtracks, (void) hits, (void) misses;
+        ok = !regex_stats(r, &s) && s.starts == 0 && s.evals[LITERAL] == 0;
+#endif
+        done++;
+        if (!ok) {
+                printf(RED "Test [%d/%d] Fail: stats of \"%s\" on \"%s\"\n" RESET, done, passed, expr, str);
+        } else {
+                passed++;
+#if !defined(HIDE_PASSED) || !HIDE_PASSED
+                printf(GREEN "Test [%d/%d] Ok\n" RESET, done, passed);
+#endif
+        }
+        regex_free(r);
+}
+
+/* regex_serialize() then regex_load(), which has to match str like expr
+ * does, with the DFA in the image if dfa is set. A copy with a byte of it
+ * changed at corrupt, if not 0, has to be refused. */
+static void
+test_image(int flags, char *expr, char *str, bool dfa, size_t corrupt)
+{
+        static int done = 0;
+        static int passed = 0;
+        Regex r = regex_compile_flags(expr, flags), loaded;
+        RegexMatch m[2] = { 0 };
+        char *image = NULL;
+        size_t len = 0;
+        FILE *f = open_memstream(&image, &len);
+        bool ok = regex_serialize(r, f);
+
+        fclose(f);
+        done++;
+        if (ok && (ok = regex_load(image, len, &loaded))) {
+                /* the lazy DFA only without one in the image */
+                ok = (loaded.image != NULL) == dfa && loaded.engine == r.engine &&
+                     (loaded.dfa != NULL) == (r.dfa != NULL && !dfa) &&
+                     regex_match(loaded, str) == regex_match(r, str);
+                ok = ok && regex_exec(loaded, str, strlen(str), &m[0], 1) == regex_exec(r, str, strlen(str), &m[1], 1) &&
+                     m[0].start == m[1].start && m[0].end == m[1].end;
+                regex_free(loaded);
+        }
+        if (ok && corrupt) {
+                image[corrupt] ^= 0x40;
+                if (regex_load(image, len, &loaded)) {
+                        regex_free(loaded);
+                        ok = false;
+                }
+        }
+        if (!ok) {
+                printf(RED "Test [%d/%d] Fail: image of \"%s\"\n" RESET, done, passed, expr);
+        } else {
+                passed++;
+#if !defined(HIDE_PASSED) || !HIDE_PASSED
+                printf(GREEN "Test [%d/%d] Ok\n" RESET, done, passed);
+#endif
+        }
+        free(image);
+        regex_free(r);
+}
+
+/* regex_load() of an image of x(a|b)*y with some fields of its header set,
+ * like "size=0 patlen=100000", and only len of its bytes, 0 for all */
+static void
+test_image_header(char *fields, size_t len, bool expected)
+{
+        static int done = 0;
+        static int passed = 0;
+        static const struct {
+                char *name;
+                size_t offset, width;
+        } HEADER[] = { { "engine", 16, 4 }, { "patlen", 20, 4 }, { "size", 24, 8 } };
+        Regex r = regex_compile_flags("x(a|b)*y", REGEX_DFA), loaded;
+        char *image = NULL, name[16];
+        size_t size = 0;
+        FILE *f = open_memstream(&image, &size);
+        unsigned long long value;
+        bool ok;
+        int n;
+
+        regex_serialize(r, f);
+        fclose(f);
+        for (char *s = fields; sscanf(s, "%15[a-z]=%llu%n", name, &value, &n) == 2; s += n + (s[n] == ' ')) {
+                for (size_t i = 0; i < sizeof HEADER / sizeof *HEADER; i++) {
+                        uint32_t v32 = value;
+                        uint64_t v64 = value;
+                        if (strcmp(HEADER[i].name, name) != 0) continue;
+                        memcpy(image + HEADER[i].offset, HEADER[i].width == 4 ? (void *) &v32 : (void *) &v64,
+                               HEADER[i].width);
+                }
+        }
+        done++;
+        if ((ok = regex_load(image, len ? len : size, &loaded))) regex_free(loaded);
+        if (ok != expected) {
+                printf(RED "Test [%d/%d] Fail: image of \"x(a|b)*y\" with %s loaded %d\n" RESET, done, passed, fields, ok);
+        } else {
+                passed++;
+#if !defined(HIDE_PASSED) || !HIDE_PASSED
+                printf(GREEN "Test [%d/%d] Ok\n" RESET, done, passed);
+#endif
+        }
+        free(image);
+        regex_free(r);
+}
+
+/* The engine regex_compile() picks for expr */
+static void
+test_pick(char *expr, int engine)
+{
+        static int done = 0;
+        static int passed = 0;
+        Regex r = regex_compile(expr);
+
+        done++;
+        if (r.engine != engine) {
+                printf(RED "Test [%d/%d] Fail: regex \"%s\" got engine %d, not %d\n" RESET, done, passed, expr, r.engine, engine);
+        } else {
+                passed++;
+#if !defined(HIDE_PASSED) || !HIDE_PASSED
+                printf(GREEN "Test [%d/%d] Ok\n" RESET, done, passed);
+#endif
+        }
+        regex_free(r);
+}
+
+/* Gets each pattern of exprs, separated by spaces, from a cache of
+ * capacity entries, releasing it unless hold. expected has a letter per
+ * get: h if it was found in the cache, c if it was compiled. */
+static void
+test_cache(size_t capacity, bool hold, char *exprs, char *expected)
+{
+        static int done = 0;
+        static int passed = 0;
+        RegexCache *cache = regex_cache_new(capacity);
+        const Regex *got[64];
+        char names[64][32];
+        char result[65] = { 0 };
+        size_t compiles = 0;
+        int n = 0;
+
+        done++;
+        for (char *s = exprs; *s; n++) {
+                size_t len = strcspn(s, " ");
+                snprintf(names[n], sizeof names[n], "%.*s", (int) len, s);
+                s += len + (s[len] == ' ');
+                got[n] = regex_cache_get(cache, names[n]);
+                result[n] = regex_cache_compiles(cache) > compiles ? 'c' : 'h';
+                compiles = regex_cache_compiles(cache);
+                if (strcmp(regex_repr(*got[n]), names[n]) != 0) result[n] = '?';
+                if (!regex_match(*got[n], names[n])) result[n] = '!';
+                if (!hold) regex_cache_release(cache, got[n]);
+        }
+        if (hold)
+                for (int i = 0; i < n; i++)
+                        regex_cache_release(cache, got[i]);
+        regex_cache_free(cache);
+
+        if (strcmp(result, expected) != 0) {
+                printf(RED "Test [%d/%d] Fail: cache of %zu got \"%s\", expected \"%s\"\n" RESET, done, passed, capacity, result, expected);
+        } else {
+                passed++;
+#if !defined(HIDE_PASSED) || !HIDE_PASSED
+                printf(GREEN "Test [%d/%d] Ok\n" RESET, done, passed);
+#endif
+        }
+}
+
+typedef struct CacheJob {
+        RegexCache *cache;
+        int first;
+        int fails;
+} CacheJob;
+
+static char *cache_exprs[] = { "ab+c", "^x*y", "[0-9]+$", "(a|b)c", "h.llo", "q?r{2}" };
+static char *cache_strs[] = { "abbbc", "xxy", "z123", "bc", "hallo", "rr" };
+
+static void *
+cache_worker(void *arg)
+{
+        CacheJob *job = arg;
+        int n = sizeof cache_exprs / sizeof *cache_exprs;
+        for (int i = 0; i < 2000; i++) {
+                int k = (job->first + i * 5) % n;
+                const Regex *r = regex_cache_get(job->cache, cache_exprs[k]);
+                if (strcmp(regex_repr(*r), cache_exprs[k]) != 0 || !regex_match(*r, cache_strs[k]) ||
+                    regex_match(*r, cache_strs[(k + 1) % n]))
+                        job->fails++;
+                regex_cache_release(job->cache, r);
+        }
+        return NULL;
+}
+
+/* Threads getting patterns from a cache too small for all of them */
+static void
+test_cache_threads(size_t capacity)
+{
+        static int done = 0;
+        static int passed = 0;
+        enum { NTHREADS = 8 };
+        pthread_t threads[NTHREADS];
+        CacheJob jobs[NTHREADS];
+        RegexCache *cache = regex_cache_new(capacity);
+        int fails = 0;
+
+        done++;
+        for (int i = 0; i < NTHREADS; i++) {
+                jobs[i] = (CacheJob) { cache, i, 0 };
+                pthread_create(&threads[i], NULL, cache_worker, &jobs[i]);
+        }
+        for (int i = 0; i < NTHREADS; i++) {
+                pthread_join(threads[i], NULL);
+                fails += jobs[i].fails;
+        }
+        regex_cache_free(cache);
+
+        if (fails) {
+                printf(RED "Test [%d/%d] Fail: %d wrong results from a cache of %zu shared between threads\n" RESET, done, passed, fails, capacity);
+        } else {
+                passed++;
+#if !defined(HIDE_PASSED) || !HIDE_PASSED
+                printf(GREEN "Test [%d/%d] Ok\n" RESET, done, passed);
+#endif
+        }
+}
+
+/* regex_match_batch() of the strings of strs, separated by spaces, with
+ * every engine. expected has a 0 or 1 per string. */
+static void
+test_batch(char *expr, char *strs, char *expected)
+{
+        static int done = 0;
+        static int passed = 0;
+        const char *bufs[64];
+        size_t lens[64], n = 0, count = 0;
+        uint8_t results[64];
+        bool ok = true;
+
+        for (char *s = strs; *s; n++) {
+                bufs[n] = s;
+                lens[n] = strcspn(s, " ");
+                s += lens[n] + (s[lens[n]] == ' ');
+                count += expected[n] == '1';
+        }
+        for (size_t e = 0; e <= sizeof ENGINES / sizeof *ENGINES; e++) {
+                Regex regex = regex_compile_flags(expr, e ? ENGINES[e - 1].flags : 0);
+                if (regex_match_batch(regex, bufs, lens, n, results) != count) ok = false;
+                for (size_t i = 0; i < n; i++)
+                        if (results[i] != (expected[i] == '1')) ok = false;
+                regex_free(regex);
+        }
+        done++;
+        if (!ok) {
+                printf(RED "Test [%d/%d] Fail: regex_match_batch() of \"%s\" on \"%s\"\n" RESET, done, passed, expr, strs);
         } else {
                 passed++;
 #if !defined(HIDE_PASSED) || !HIDE_PASSED
@@ -133,6 +928,23 @@ main()
         /* 89 */ test(regex_compile("a{0,1}"), "");
         /* 90 */ test(regex_compile("a{0,1}"), "a");
         /* 91 */ test(regex_compile("^a{1,1}$"), "a");
+        /* 92 */ test(regex_compile("^a{3}$"), "aaa");
+        /* 93 */ test(regex_compile("^[a-]$"), "-");
+        /* 94 */ test(regex_compile("^[^a-z]$"), "-");
+        /* 95 */ test(regex_compile("^[a-cx-z]+$"), "abczyx");
+        /* 96 */ test(regex_compile("[0-9]x[0-9]"), "1x2");
+        /* 97 */ test(regex_compile("abd"), "abcabd");
+        /* 98 */ test(regex_compile("ab+c"), "abababbc");
+        /* 99 */ test(regex_compile("x(yz)+$"), "xyzxyzyz");
+        /* 100 */ test(regex_compile("[0-9]+ms"), "took 12 s, 130ms");
+        /* 101 */ test(regex_compile("^(a[bc])d$"), "abd");
+        /* 102 */ test(regex_compile("^(a|b)+$"), repeat("ab", 2000));
+        /* 103 */ test(regex_compile("a[bc]*d$"), "xxabcbd");
+        /* 104 */ test(regex_compile("(ab)+$"), "xabab");
+        /* 105 */ test(regex_compile("a{2,3}$"), "baaaa");
+        /* 106 */ test(regex_compile("a*$"), "bbb");
+        /* 107 */ test(regex_compile("[^a]$"), "aab");
+        /* 108 */ test(regex_compile("x(a|b)*y$"), "xxayxaby");
 
         /* 01 */ test_not(regex_compile("a"), "");
         /* 02 */ test_not(regex_compile("a"), "b");
@@ -188,6 +1000,221 @@ main()
         /* 52 */ test_not(regex_compile("^a{0,1}$"), "aa");
         /* 53 */ test_not(regex_compile("^a{1,1}$"), "aa");
         /* 54 */ test_not(regex_compile("^a{1,1}$"), "");
+        /* 55 */ test_not(regex_compile("^[a-z]$"), "-");
+        /* 56 */ test_not(regex_compile("^[a-cx-z]+$"), "abcd");
+        /* 57 */ test_not(regex_compile("[^\\]]"), "]");
+        /* 58 */ test_not(regex_compile("^a{3}$"), "aaaa");
+        /* 59 */ test_not(regex_compile("abd"), "abcabcab");
+        /* 60 */ test_not(regex_compile(".at"), "at");
+        /* 61 */ test_not(regex_compile("x(yz)+$"), "xyzxyzy");
+        /* 62 */ test_not(regex_compile("[0-9]+ms"), "took 12 s, ms");
+        /* 63 */ test_not(regex_compile("a[bc]*d$"), "abcdx");
+        /* 64 */ test_not(regex_compile("(ab)+$"), "abba");
+        /* 65 */ test_not(regex_compile("[.]com$"), "a.co");
+        /* 66 */ test_not(regex_compile("x(a|b)*y$"), "yxaby ");
+        /* 67 */ test_not(regex_compile("abc"), "ab");
+        /* 68 */ test_not(regex_compile("[xy]z{3}"), "azzz yzz");
+
+        /* 01 */ test_n(regex_compile("^abc$"), "abcdef", 3, true);
+        /* 02 */ test_n(regex_compile("^abc$"), "abcdef", 2, false);
+        /* 03 */ test_n(regex_compile("cde"), "abcdef", 4, false);
+        /* 04 */ test_n(regex_compile("a.c"), "a\0c", 3, true);
+        /* 05 */ test_n(regex_compile("^a[^b]c$"), "a\0c", 3, true);
+        /* 06 */ test_n(regex_compile("a[bc]d"), "a\0d", 3, false);
+        /* 07 */ test_n(regex_compile("d$"), "abc\0d", 5, true);
+        /* 08 */ test_n(regex_compile("^$"), "", 0, true);
+
+        /* 01 */ test_engine(REGEX_NFA, "(a*)*b", repeat("a", 20000), false);
+        /* 02 */ test_engine(REGEX_NFA, "a([ab]|c)*c", repeat("ab", 20000), false);
+        /* 03 */ test_engine(REGEX_NFA, "^a([ab]|c)*c$", repeat("ac", 20000), true);
+        /* 04 */ test_engine(REGEX_NFA, "(ab*)c", "abbbc", true);
+        /* 05 */ test_engine(REGEX_NFA, "x(a|b)*y", "xababy", true);
+        /* 06 */ test_engine(REGEX_DFA, "(a*)*b", repeat("a", 20000), false);
+        /* 07 */ test_engine(REGEX_DFA, "^a([ab]|c)*c$", repeat("ac", 20000), true);
+        /* 08 */ test_engine(REGEX_DFA, "(ab*)c", "abbbc", true);
+        /* 09 */ test_engine(REGEX_DFA, "a(a|b){12,12}$", strcat(noise("ab", 30000), "abbbbbbbbbbbb"), true);
+        /* 10 */ test_engine(REGEX_DFA, "a(a|b){12,12}$", strcat(noise("ab", 30000), "babbbbbbbbbbb"), false);
+        /* 11 */ test_engine(REGEX_BACKTRACK, "^a*$", repeat("a", 5000), true);
+        /* 12 */ test_engine(REGEX_BACKTRACK, "^a{1000,}$", repeat("a", 1500), true);
+        /* 13 */ test_engine(REGEX_BACKTRACK, "^(a|b)*c", strcat(repeat("ab", 30000), "c"), true);
+        /* 14 */ test_engine(REGEX_BACKTRACK, "^(.)*b$", strcat(repeat("a", 30000), "b"), true);
+        /* 15 */ test_engine(REGEX_JIT, "@[a-z]+[.]com", strcat(repeat("x", 30001), "@abc.com"), true);
+        /* 16 */ test_engine(REGEX_JIT, "^[a-y]*z", strcat(repeat("ab", 20000), "cz"), true);
+        /* 17 */ test_engine(REGEX_JIT, "^[a-y]*z", strcat(repeat("ab", 20000), "#z"), false);
+        /* 18 */ test_engine(REGEX_GLUSHKOV, "^a(a|b)+c$", strcat(repeat("ab", 20000), "c"), true);
+        /* 19 */ test_engine(REGEX_GLUSHKOV, "^[ab]{63}y", strcat(repeat("ab", 31), "ay"), true);
+        /* 20 */ test_engine(REGEX_GLUSHKOV, "^[ab]{64}y", strcat(repeat("ab", 32), "y"), true);
+
+        /* 01 */ test_exec("a(b)c", "xabcx", 2, (long[]) { 1, 4, 2, 3 });
+        /* 02 */ test_exec("a(b)c", "abd", 2, NULL);
+        /* 03 */ test_exec("(a|b)*(b)", "xabab", 3, (long[]) { 1, 5, 3, 4, 4, 5 });
+        /* 04 */ test_exec("(a*)(a*)", "aaa", 3, (long[]) { 0, 3, 0, 3, 3, 3 });
+        /* 05 */ test_exec("x(a)?y", "xy", 2, (long[]) { 0, 2, -1, -1 });
+        /* 06 */ test_exec("^(ab)+$", "ababab", 2, (long[]) { 0, 6, 4, 6 });
+        /* 07 */ test_exec("([0-9]+)-([0-9]+)", "port 80-443 open", 3, (long[]) { 5, 11, 5, 7, 8, 11 });
+        /* 08 */ test_exec("$", "ab", 1, (long[]) { 2, 2 });
+        /* 09 */ test_exec("b(c)", "abcbc", 3, (long[]) { 1, 3, 2, 3, -1, -1 });
+        /* 10 */ test_exec("((a)|b)+", "ab", 3, (long[]) { 0, 2, 1, 2, 0, 1 });
+        /* 11 */ test_exec("(a+)(b+)?", "caab", 3, (long[]) { 1, 4, 1, 3, 3, 4 });
+        /* 12 */ test_exec("(b+)c$", "abcbbc", 2, (long[]) { 3, 6, 3, 5 });
+        /* 13 */ test_exec("(b+)c$", "abcbbcd", 2, NULL);
+
+        /* 01 */ test_iter("a+", "baaacaab", (long[]) { 1, 4, 5, 7, -1 });
+        /* 02 */ test_iter("a*", "baac", (long[]) { 0, 0, 1, 3, 4, 4, -1 });
+        /* 03 */ test_iter("[0-9]+", "a1b22c333", (long[]) { 1, 2, 3, 5, 6, 9, -1 });
+        /* 04 */ test_iter("^a", "aaa", (long[]) { 0, 1, -1 });
+        /* 05 */ test_iter("a$", "aaa", (long[]) { 2, 3, -1 });
+        /* 06 */ test_iter("ab", "abab", (long[]) { 0, 2, 2, 4, -1 });
+        /* 07 */ test_iter("(a|b)c", "acbccc", (long[]) { 0, 2, 2, 4, -1 });
+        /* 08 */ test_iter("x", "abc", (long[]) { -1 });
+        /* 09 */ test_iter("b*", "", (long[]) { 0, 0, -1 });
+        /* 10 */ test_iter("a.", "aaaa", (long[]) { 0, 2, 2, 4, -1 });
+        /* 11 */ test_iter("a+$", "aab aa", (long[]) { 4, 6, -1 });
+
+        /* 01 */ test_stream("ab", "xxabyyab", (long[]) { 2, 4, 6, 8, -1 });
+        /* 02 */ test_stream("a+", "baaac", (long[]) { 1, 2, 2, 3, 3, 4, -1 });
+        /* 03 */ test_stream("[0-9]+ms", "took 12ms and 3ms", (long[]) { 5, 9, 14, 17, -1 });
+        /* 04 */ test_stream("a$", "aaa", (long[]) { 2, 3, -1 });
+        /* 05 */ test_stream("^ab", "abab", (long[]) { 0, 2, -1 });
+        /* 06 */ test_stream("x(a|b){3}y", "zxabaxbbbyxab", (long[]) { 5, 10, -1 });
+        /* 07 */ test_stream("$", "ab", (long[]) { 2, 2, -1 });
+        /* 08 */ test_stream("^$", "", (long[]) { 0, 0, -1 });
+        /* 09 */ test_stream("b*", "ab", (long[]) { 0, 0, 1, 1, 2, 2, -1 });
+        /* 10 */ test_stream("abc", "ababcabc", (long[]) { 2, 5, 5, 8, -1 });
+        /* 11 */ test_stream("x", "abc", (long[]) { -1 });
+
+        char *rules[] = { "error", "warn", "^GET ", "timeout$", "[0-9]+ms", "user=[a-z]+",
+                          "err", "error", "(a|b)*c", "x{2,3}y", "", "^$", "disk", "rror" };
+        int nrules = sizeof rules / sizeof *rules;
+        /* 01 */ test_set(rules, nrules, "GET /index error after 120ms");
+        /* 02 */ test_set(rules, nrules, "request timeout");
+        /* 03 */ test_set(rules, nrules, "");
+        /* 04 */ test_set(rules, nrules, "user=bob xxy warn aabac");
+        /* 05 */ test_set(rules, nrules, "nothing to see here");
+        /* 06 */ test_set(rules + 8, 2, "xxxy");
+        /* 07 */ test_set(rules, 2, "warning");
+
+        char *many[300];
+        unsigned x = 1;
+        for (int i = 0; i < 300; i++) {
+                many[i] = malloc(16);
+                if (i % 3 == 0) {
+                        snprintf(many[i], 16, "%c[bcd]{%d}%c", 'a' + i % 4, 1 + i % 3, 'a' + i % 3);
+                        continue;
+                }
+                int n = 3 + i % 4;
+                for (int k = 0; k < n; k++) {
+                        x = x * 1103515245 + 12345;
+                        many[i][k] = "abcd"[(x >> 16) % 4];
+                }
+                many[i][n] = 0;
+        }
+        /* 08 */ test_set(many, 300, noise("abcd", 200));
+        /* 09 */ test_set(many, 300, noise("abcd", 2000));
+        /* 10 */ test_set(many, 64, "abcdabcd");
+        for (int i = 0; i < 300; i++)
+                free(many[i]);
+
+        /* 01 */ test_threads("a(a|b){12}$", REGEX_DFA);
+        /* 02 */ test_threads("b(a|b){3,5}a", REGEX_DFA);
+        /* 03 */ test_threads("^(ab|b)*a{2,}", REGEX_DFA);
+        /* 04 */ test_threads("a(a|b){12}$", REGEX_NFA);
+        /* 05 */ test_threads("^(ab|b)*a{2,}", REGEX_BACKTRACK);
+        /* 06 */ test_threads("b(a|b){3,5}a", REGEX_JIT);
+
+        /* 01 */ test_limited(REGEX_BACKTRACK, "(a*)*b", "aaaaaaaaaaaacb", 100, false, REGEX_BUDGET_EXCEEDED);
+        /* 02 */ test_limited(REGEX_BACKTRACK, "^(a|b)*c", "ababc", 1000, true, REGEX_OK);
+        /* 03 */ test_limited(REGEX_BACKTRACK, "^a(b|c)d", "acd", 100, true, REGEX_OK);
+        /* 04 */ test_limited(REGEX_BACKTRACK, "^a(b|c)d", "acd", 3, false, REGEX_BUDGET_EXCEEDED);
+        char *xs = strdup(repeat("a", 1000));
+        xs[998] = 'a';
+        xs[999] = 'c';
+        /* 05 */ test_limited(REGEX_NFA, "[ab]c", xs, 100, false, REGEX_BUDGET_EXCEEDED);
+        /* 06 */ test_limited(REGEX_NFA, "[ab]c", xs, 100000, true, REGEX_OK);
+        /* 07 */ test_limited(REGEX_DFA, "[ab]c", xs, 100, false, REGEX_BUDGET_EXCEEDED);
+        /* 08 */ test_limited(REGEX_DFA, "[ab]c", xs, 1000, true, REGEX_OK);
+        /* 09 */ test_limited(REGEX_DFA, "a[bx]*$", "xabxx", 3, false, REGEX_BUDGET_EXCEEDED);
+        /* 10 */ test_limited(REGEX_DFA, "a[bx]*$", "xabxx", 4, true, REGEX_OK);
+        free(xs);
+        /* failures are memoized, no longer exponential */
+        /* 11 */ test_limited(REGEX_BACKTRACK, "(a*)*b", strcat(repeat("a", 200), "cb"), 1000000, true, REGEX_OK);
+        /* 12 */ test_limited(REGEX_BACKTRACK, "^(a|b)*(a|b)*(a|b)*d", strcat(repeat("ab", 100), "cd"), 1000000, false, REGEX_OK);
+        /* 13 */ test_limited(REGEX_BACKTRACK, "(a|b)*(a*)*$", strcat(repeat("ab", 100), "c"), 1000000, true, REGEX_OK);
+
+        /* $ patterns read from the end and stop early */
+        /* 14 */ test_limited(REGEX_DFA, "[.]com$", strcat(repeat("x", 5000), ".org"), 4, false, REGEX_OK);
+        /* 15 */ test_limited(REGEX_NFA, "[.]com$", strcat(repeat("x", 5000), ".org"), 8, false, REGEX_OK);
+        /* 16 */ test_limited(REGEX_DFA, "[a-z]+[.]com$", strcat(repeat("x", 5000), ".com"), 10, true, REGEX_OK);
+
+        /* 01 */ test_stack("^(a|b)*$", 1 << 20, true);
+        /* 02 */ test_stack("^(ab)+$", 1 << 20, true);
+        /* 03 */ test_stack("^((a|b)(a|b))*a$", 1 << 20, false);
+
+        /* 01 */ test_span("abc", 3, 3, "a");
+        /* 02 */ test_span("a*b", 1, -1, "ab");
+        /* 03 */ test_span("((ab)|c)d", 2, 3, "ac");
+        /* 04 */ test_span("x{2,4}y?", 2, 5, "x");
+        /* 05 */ test_span("[0-3]+z", 2, -1, "0123");
+        /* 06 */ test_span("^abc$", 3, 3, NULL);
+        /* 07 */ test_span("a*", 0, -1, NULL);
+        /* 08 */ test_span("(a?b?)c", 1, 3, "abc");
+        /* 09 */ test_span("a{0}b", 1, 1, "b");
+        /* 10 */ test_span("x(a|b)", 2, 2, "x");
+
+        /* 01 */ test_codegen("[a-z]+[.]com$", true, "abc.com abc.org .com x.com.au");
+        /* 02 */ test_codegen("^[0-9]+$", true, "123 12a a12 0");
+        /* 03 */ test_codegen("a*", true, "a b aaa");
+        /* 04 */ test_codegen("(a|b)*a(a|b){20}", false, "");
+        /* 05 */ test_codegen("a*/x", true, "aa/x /x a/y xa/");
+        /* 06 */ test_codegen("b/*c", true, "bc b//c b/c bx");
+        /* 07 */ test_codegen("a'b", true, "a'b ab 'a'b'");
+
+        /* 01 */ test_batch("a[bc]+d", "abd xbcd ad abcbcdx acd", "10011");
+        /* 02 */ test_batch("@[a-z]+[.]com$", "x@y.com x@y.org @.com a.org@bc.com  a@b.co", "100100");
+        /* 03 */ test_batch("^(ab|b)*a{2,}", "aa ba abaa abbaa", "1010");
+        /* 04 */ test_batch("x", "", "");
+
+        /* 01 */ test_pick("[hc]at", REGEX_GLUSHKOV);
+        /* 02 */ test_pick("^ba+c$", REGEX_GLUSHKOV);
+        /* 03 */ test_pick("ab?c", REGEX_GLUSHKOV);
+        /* 04 */ test_pick("^[ab]{63}y", REGEX_GLUSHKOV);
+        /* 05 */ test_pick("^[ab]{64}y", REGEX_DFA);
+        /* 06 */ test_pick("[.]com$", REGEX_DFA);
+        /* 07 */ test_pick("a^b", REGEX_DFA);
+
+        /* 01 */ test_image(REGEX_DFA, "[hc]at", "the cat", true, 0);
+        /* 02 */ test_image(REGEX_DFA, "[a-z]+[.]com$", "abc.com", true, 0);
+        /* 03 */ test_image(REGEX_DFA, "[a-z]+[.]com$", "abc.org", true, 0);
+        /* 04 */ test_image(0, "^ba+c$", "baaac", false, 0);
+        /* 05 */ test_image(REGEX_DFA, "(a|b)*a(a|b){20}", "ab", false, 0);
+        /* 06 */ test_image(REGEX_NFA, "a(b|c)*d", "abcbd", false, 0);
+        /* 07 */ test_image(REGEX_DFA, "x(a|b)*y", "xababy", true, 0);
+        /* 08 */ test_image(REGEX_DFA, "x(a|b)*y", "xababy", true, 1);
+        /* 09 */ test_image(REGEX_DFA, "x(a|b)*y", "xababy", true, 12);
+        /* 10 */ test_image(REGEX_DFA, "x(a|b)*y", "xababy", true, 72);
+
+        /* 01 */ test_image_header("", 0, true);
+        /* 02 */ test_image_header("size=0 patlen=100000", 48, false);
+        /* 03 */ test_image_header("size=40", 0, false);
+        /* 04 */ test_image_header("", 100, false);
+        /* 05 */ test_image_header("engine=3", 0, false);
+        /* 06 */ test_image_header("engine=32", 0, false);
+        /* 07 */ test_image_header("engine=12", 0, true);
+        /* 08 */ test_image_header("engine=0", 0, true);
+
+        /* 01 */ test_stats("a*b", "aac", 0, 0, 0, 1);
+        /* 02 */ test_stats("^a*ab", "aaab", 1, 1, 1, 0);
+        /* 03 */ test_stats("x(a|b)*y", "zxababyq", 1, 0, 1, 0);
+        /* 04 */ test_stats("a(b|c)d", "abxacd", 2, 0, 2, 0);
+
+        /* 01 */ test_cache(4, false, "ab ab cd ab", "chch");
+        /* 02 */ test_cache(2, false, "ab cd ab ef ab cd", "cchchc");
+        /* 03 */ test_cache(2, true, "ab cd ef ab ef", "ccchc");
+        /* 04 */ test_cache(1, false, "ab ab cd cd ab", "chchc");
+        /* 05 */ test_cache(0, false, "ab ab", "cc");
+        /* 06 */ test_cache_threads(2);
+        /* 07 */ test_cache_threads(6);
+        /* 08 */ test_cache_threads(64);
 
         return 0;
 }